@@ -0,0 +1,69 @@
+#pragma once
+#include <cfloat>
+#include <glm/glm.hpp>
+using namespace glm;
+
+class AABB
+{
+public:
+	vec3 lower = vec3(FLT_MAX);
+	vec3 upper = vec3(-FLT_MAX);
+
+	AABB()
+	{
+	}
+
+	AABB(const vec3& lower, const vec3& upper) : lower(lower), upper(upper)
+	{
+	}
+
+	void Expand(const vec3& p)
+	{
+		lower = glm::min(lower, p);
+		upper = glm::max(upper, p);
+	}
+
+	void Expand(const AABB& box)
+	{
+		lower = glm::min(lower, box.lower);
+		upper = glm::max(upper, box.upper);
+	}
+
+	bool IsEmpty() const
+	{
+		return lower.x > upper.x || lower.y > upper.y || lower.z > upper.z;
+	}
+
+	vec3 Center() const
+	{
+		return (lower + upper) * 0.5f;
+	}
+
+	float SurfaceArea() const
+	{
+		if (IsEmpty()) return 0;
+
+		vec3 e = upper - lower;
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	int LongestAxis() const
+	{
+		vec3 e = upper - lower;
+		if (e.x > e.y && e.x > e.z) return 0;
+		return e.y > e.z ? 1 : 2;
+	}
+
+	bool IntersectRay(const vec3& start, const vec3& invDir, float tMax, float& tNear) const
+	{
+		vec3 t0 = (lower - start) * invDir;
+		vec3 t1 = (upper - start) * invDir;
+		vec3 tEnter = glm::min(t0, t1);
+		vec3 tExit = glm::max(t0, t1);
+
+		tNear = glm::max(glm::max(tEnter.x, tEnter.y), glm::max(tEnter.z, 0.0f));
+		float tFar = glm::min(glm::min(tExit.x, tExit.y), glm::min(tExit.z, tMax));
+
+		return tNear <= tFar;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,250 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Raytracer.h"
+
+// Renders frames on a thread of its own so the caller never waits for a trace. Jobs are queued and
+// run in order; each returns a future and may also call back on completion. Finished frames land
+// in a ring of framebuffers, locked on the render thread while it traces into them, and the
+// presenter keeps showing the latest one while the next is traced. While a job runs the Raytracer
+// belongs to the render thread: change the scene or camera in the job's setup, after Cancel if the
+// frame in flight is no longer wanted.
+class AsyncRenderer
+{
+public:
+	struct FrameResult
+	{
+		uint64_t frame = 0;     // last frame the job published, 0 if none
+		bool completed = false; // false if the job was cancelled
+		double seconds = 0;
+		TraceStats stats;
+	};
+
+	struct FrameJob
+	{
+		// Runs on the render thread before tracing.
+		std::function<void(Raytracer&)> setup;
+
+		// Refine with RenderProgressive from zero samples, publishing a frame every budget
+		// seconds until it converges, instead of one Render.
+		bool progressive = false;
+		double budget = 0.05;
+
+		// Render through the reprojection cache, for frames that only move the camera.
+		bool reproject = false;
+
+		// Runs on the render thread once the job is done or cancelled.
+		std::function<void(const FrameResult&)> onComplete;
+	};
+
+	// Two buffers can only start a frame once the presenter has let go of the older one; three
+	// never wait.
+	AsyncRenderer(Raytracer& raytracer, int bufferCount = 3, PixelFormat format = PixelFormat::RGBA8) : raytracer(raytracer)
+	{
+		for (int i = 0; i < glm::max(bufferCount, 2); i++) buffers.push_back(std::make_unique<MemoryFramebuffer>(raytracer.width, raytracer.height, format));
+
+		thread = std::thread(&AsyncRenderer::RenderLoop, this);
+	}
+
+	// Renders into the given framebuffers instead, at least two of the raytracer's size, such as
+	// textures the presenter copies to the screen.
+	AsyncRenderer(Raytracer& raytracer, std::vector<std::unique_ptr<Framebuffer>> ring) : raytracer(raytracer), buffers(std::move(ring))
+	{
+		thread = std::thread(&AsyncRenderer::RenderLoop, this);
+	}
+
+	~AsyncRenderer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		Cancel();
+		thread.join();
+	}
+
+	AsyncRenderer(const AsyncRenderer&) = delete;
+	AsyncRenderer& operator=(const AsyncRenderer&) = delete;
+
+	std::future<FrameResult> Submit(FrameJob job)
+	{
+		Pending pending{ std::move(job), std::promise<FrameResult>() };
+		std::future<FrameResult> result = pending.promise.get_future();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(pending));
+		}
+		cv.notify_all();
+
+		return result;
+	}
+
+	// Drops the queued jobs and stops the one in flight; their futures report completed = false.
+	void Cancel()
+	{
+		std::deque<Pending> dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			dropped.swap(jobs);
+			if (busy) raytracer.cancelRequested = true;
+		}
+		cv.notify_all();
+
+		for (auto& pending : dropped) Finish(pending, FrameResult());
+	}
+
+	// Latest finished frame, or nullptr before the first. It stays untouched until the next call,
+	// which releases it; frame tells whether it changed since then.
+	Framebuffer* Present(uint64_t& frame)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		held = latest;
+		frame = latestFrame;
+		cv.notify_all();
+
+		return held >= 0 ? buffers[held].get() : nullptr;
+	}
+
+	bool Idle()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return !busy && jobs.empty();
+	}
+
+private:
+	struct Pending
+	{
+		FrameJob job;
+		std::promise<FrameResult> promise;
+	};
+
+	Raytracer& raytracer;
+	std::vector<std::unique_ptr<Framebuffer>> buffers;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Pending> jobs;
+	bool busy = false;
+	bool quit = false;
+
+	int latest = -1, held = -1, rendering = -1;
+	uint64_t latestFrame = 0;
+
+	void RenderLoop()
+	{
+		for (;;)
+		{
+			Pending pending;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [&] { return quit || !jobs.empty(); });
+				if (quit) return;
+
+				pending = std::move(jobs.front());
+				jobs.pop_front();
+
+				busy = true;
+				raytracer.cancelRequested = false;
+			}
+
+			const FrameResult result = Run(pending.job);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy = false;
+			}
+			Finish(pending, result);
+		}
+	}
+
+	FrameResult Run(const FrameJob& job)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		FrameResult result;
+
+		if (job.setup) job.setup(raytracer);
+
+		if (job.progressive) raytracer.ResetProgressive();
+
+		bool cancelled = false;
+		do
+		{
+			const int buffer = AcquireBuffer();
+			const FramebufferView target = buffer >= 0 ? buffers[buffer]->Lock() : FramebufferView();
+			if (!target.data)
+			{
+				if (buffer >= 0) ReleaseBuffer(buffer);
+				cancelled = true;
+				break;
+			}
+
+			// every buffer of the ring gets the whole frame, so progressive passes resolve in full
+			if (job.progressive) raytracer.RenderProgressive(target, job.budget, false);
+			else if (job.reproject) raytracer.RenderReprojected(target);
+			else raytracer.Render(target);
+			buffers[buffer]->Unlock();
+
+			result.stats += raytracer.lastStats;
+			if (raytracer.cancelRequested)
+			{
+				ReleaseBuffer(buffer);
+				cancelled = true;
+				break;
+			}
+
+			result.frame = Publish(buffer);
+		} while (job.progressive && !raytracer.ProgressiveConverged());
+
+		result.completed = !cancelled;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return result;
+	}
+
+	// A buffer that is neither the latest frame nor held by the presenter; -1 if cancelled first.
+	int AcquireBuffer()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		int free = -1;
+		cv.wait(lock, [&] {
+			for (int i = 0; i < int(buffers.size()) && free < 0; i++)
+				if (i != latest && i != held && i != rendering) free = i;
+			return free >= 0 || raytracer.cancelRequested;
+		});
+
+		if (raytracer.cancelRequested) return -1;
+
+		rendering = free;
+		return free;
+	}
+
+	void ReleaseBuffer(int buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (rendering == buffer) rendering = -1;
+	}
+
+	uint64_t Publish(int buffer)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		rendering = -1;
+		latest = buffer;
+		return ++latestFrame;
+	}
+
+	void Finish(Pending& pending, const FrameResult& result)
+	{
+		if (pending.job.onComplete) pending.job.onComplete(result);
+		pending.promise.set_value(result);
+	}
+};
@@ -0,0 +1,336 @@
+#pragma once
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "AABB.h"
+#include "Ray.h"
+#include "TraceStats.h"
+#include "TileScheduler.h"
+using namespace glm;
+
+class BVH
+{
+public:
+	struct Node
+	{
+		AABB bounds;
+		int left = 0; // first child for inner nodes, first entry of indices for leaves
+		int count = 0; // 0 for inner nodes
+	};
+
+	static const int binCount = 16;
+	static const int maxDepth = 60;
+	static const int stackSize = 64;
+
+	float traversalCost = 1.0f;
+	float intersectionCost = 1.0f;
+	int maxLeafSize = 4;
+
+	// Builds with more primitives than this split their subtrees across the scheduler's threads.
+	static const int parallelThreshold = 4096;
+
+	std::vector<Node> nodes;
+	std::vector<int> indices;
+
+	// With tiles, the top of the tree is split serially until the pending subtrees are small
+	// enough to share out, then each subtree is built on a worker into a node list of its own
+	// and appended. The splits are the same either way; only the node order differs.
+	void Build(const std::vector<AABB>& primBounds, TileScheduler* tiles = nullptr)
+	{
+		nodes.clear();
+		indices.resize(primBounds.size());
+		std::iota(indices.begin(), indices.end(), 0);
+
+		if (primBounds.empty()) return;
+
+		std::vector<vec3> centers(primBounds.size());
+		for (size_t i = 0; i < primBounds.size(); i++) centers[i] = primBounds[i].Center();
+
+		const int primCount = int(primBounds.size());
+		std::vector<Subtree> subtrees;
+		const int deferBelow = tiles && primCount > parallelThreshold ? glm::max(primCount / (tiles->ThreadCount() * 8), parallelThreshold / 4) : 0;
+
+		nodes.reserve(primBounds.size() * 2);
+		nodes.push_back(Node());
+		Subdivide(nodes, 0, 0, primCount, 0, primBounds, centers, deferBelow, &subtrees);
+
+		if (subtrees.empty()) return;
+
+		tiles->RunRange(int(subtrees.size()), 1, [&](int begin, int end, int) {
+			for (int i = begin; i < end; i++)
+			{
+				Subtree& subtree = subtrees[i];
+				subtree.nodes.push_back(Node());
+				Subdivide(subtree.nodes, 0, subtree.first, subtree.count, subtree.depth, primBounds, centers, 0, nullptr);
+			}
+		});
+
+		// the subtree root takes the deferred node's place and the rest is appended, so children stay adjacent
+		for (Subtree& subtree : subtrees)
+		{
+			const int base = int(nodes.size()) - 1;
+			for (Node& node : subtree.nodes)
+				if (node.count == 0) node.left += base;
+
+			nodes[subtree.node] = subtree.nodes[0];
+			nodes.insert(nodes.end(), subtree.nodes.begin() + 1, subtree.nodes.end());
+		}
+	}
+
+	// Recomputes every node's bounds from moved primitives, keeping the tree. Children always come
+	// after their parent, so one backward pass suffices.
+	void Refit(const std::vector<AABB>& primBounds)
+	{
+		for (int i = int(nodes.size()) - 1; i >= 0; i--)
+		{
+			Node& node = nodes[i];
+			node.bounds = AABB();
+
+			if (node.count > 0)
+			{
+				for (int k = node.left; k < node.left + node.count; k++) node.bounds.Expand(primBounds[indices[k]]);
+			}
+			else
+			{
+				node.bounds.Expand(nodes[node.left].bounds);
+				node.bounds.Expand(nodes[node.left + 1].bounds);
+			}
+		}
+	}
+
+	// Moving every primitive by the same offset moves every node with it.
+	void Translate(const vec3& offset)
+	{
+		for (Node& node : nodes)
+		{
+			node.bounds.lower += offset;
+			node.bounds.upper += offset;
+		}
+	}
+
+	// Expected cost of tracing a ray that hits the root, by the surface area heuristic. Refitting
+	// after large motions lets nodes overlap and grow, which shows up as a higher cost.
+	float Cost() const
+	{
+		if (nodes.empty()) return 0;
+
+		const float rootArea = nodes[0].bounds.SurfaceArea();
+		if (rootArea <= 0) return 0;
+
+		float cost = 0;
+		for (const Node& node : nodes)
+			cost += node.bounds.SurfaceArea() * (node.count > 0 ? intersectionCost * node.count : traversalCost);
+
+		return cost / rootArea;
+	}
+
+	bool IsEmpty() const
+	{
+		return nodes.empty();
+	}
+
+	// intersect(prim, tMax) tests one primitive and shrinks tMax when it finds a closer hit.
+	template<typename Intersect>
+	void Traverse(const Ray& ray, float& tMax, Intersect intersect) const
+	{
+		TraverseLeaves(ray, tMax, [&](int first, int count, float& t) {
+			for (int i = first; i < first + count; i++) intersect(indices[i], t);
+		});
+	}
+
+	// Any-hit query: test(prim) returns true when prim blocks the ray, which ends the traversal.
+	// Returns whether some prim did.
+	template<typename Test>
+	bool TraverseAny(const Ray& ray, float tMax, Test test) const
+	{
+		bool found = false;
+
+		TraverseLeaves(ray, tMax, [&](int first, int count, float& t) {
+			for (int i = first; i < first + count && !found; i++) found = test(indices[i]);
+			if (found) t = -1; // no remaining node can pass the tNear > tMax check
+		});
+
+		return found;
+	}
+
+	// visit(first, count, tMax) receives each leaf as the range [first, first + count) of indices.
+	template<typename Visit>
+	void TraverseLeaves(const Ray& ray, float& tMax, Visit visit) const
+	{
+		if (nodes.empty()) return;
+
+		const vec3 invDir = 1.0f / ray.dir;
+
+		struct Entry
+		{
+			int node;
+			float tNear;
+		};
+		Entry stack[stackSize];
+		int top = 0;
+
+		float tNear;
+		if (!nodes[0].bounds.IntersectRay(ray.start, invDir, tMax, tNear)) return;
+		stack[top++] = Entry{ 0, tNear };
+
+		while (top > 0)
+		{
+			const Entry entry = stack[--top];
+			if (entry.tNear > tMax) continue;
+
+			const Node& node = nodes[entry.node];
+			TRACE_STAT(threadStats.nodeVisits++);
+			if (node.count > 0)
+			{
+				visit(node.left, node.count, tMax);
+				continue;
+			}
+
+			float t0, t1;
+			const bool hit0 = nodes[node.left].bounds.IntersectRay(ray.start, invDir, tMax, t0);
+			const bool hit1 = nodes[node.left + 1].bounds.IntersectRay(ray.start, invDir, tMax, t1);
+
+			if (hit0 && hit1)
+			{
+				if (t0 <= t1)
+				{
+					stack[top++] = Entry{ node.left + 1, t1 };
+					stack[top++] = Entry{ node.left, t0 };
+				}
+				else
+				{
+					stack[top++] = Entry{ node.left, t0 };
+					stack[top++] = Entry{ node.left + 1, t1 };
+				}
+			}
+			else if (hit0) stack[top++] = Entry{ node.left, t0 };
+			else if (hit1) stack[top++] = Entry{ node.left + 1, t1 };
+		}
+	}
+
+private:
+	struct Bin
+	{
+		AABB bounds;
+		int count = 0;
+	};
+
+	// A node whose children were left for a worker, with the node list they are built into.
+	struct Subtree
+	{
+		int node, first, count, depth;
+		std::vector<Node> nodes;
+	};
+
+	// Splits nodes[nodeIndex] over indices [first, first + count). Inner nodes of at most
+	// deferBelow primitives are queued on subtrees instead of being split further.
+	void Subdivide(std::vector<Node>& nodes, int nodeIndex, int first, int count, int depth, const std::vector<AABB>& primBounds, const std::vector<vec3>& centers,
+		int deferBelow, std::vector<Subtree>* subtrees)
+	{
+		AABB bounds, centerBounds;
+		for (int i = first; i < first + count; i++)
+		{
+			bounds.Expand(primBounds[indices[i]]);
+			centerBounds.Expand(centers[indices[i]]);
+		}
+
+		nodes[nodeIndex].bounds = bounds;
+		nodes[nodeIndex].left = first;
+		nodes[nodeIndex].count = count;
+
+		if (count <= 1 || depth >= maxDepth) return;
+
+		if (count <= deferBelow)
+		{
+			subtrees->push_back(Subtree{ nodeIndex, first, count, depth, {} });
+			return;
+		}
+
+		int bestAxis = -1;
+		int bestSplit = 0;
+		float bestCost = FLT_MAX;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float lo = centerBounds.lower[axis];
+			const float extent = centerBounds.upper[axis] - lo;
+			if (extent <= 0) continue;
+
+			Bin bins[binCount];
+			for (int i = first; i < first + count; i++)
+			{
+				const int b = BinIndex(centers[indices[i]][axis], lo, extent);
+				bins[b].count++;
+				bins[b].bounds.Expand(primBounds[indices[i]]);
+			}
+
+			float leftArea[binCount - 1];
+			int leftCount[binCount - 1];
+			AABB acc;
+			int n = 0;
+			for (int b = 0; b < binCount - 1; b++)
+			{
+				acc.Expand(bins[b].bounds);
+				n += bins[b].count;
+				leftArea[b] = acc.SurfaceArea();
+				leftCount[b] = n;
+			}
+
+			acc = AABB();
+			n = 0;
+			for (int b = binCount - 1; b > 0; b--)
+			{
+				acc.Expand(bins[b].bounds);
+				n += bins[b].count;
+
+				if (leftCount[b - 1] == 0 || n == 0) continue;
+
+				const float cost = leftArea[b - 1] * leftCount[b - 1] + acc.SurfaceArea() * n;
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = b;
+				}
+			}
+		}
+
+		int mid;
+		if (bestAxis < 0)
+		{
+			// every centroid coincides, so no plane separates them
+			if (count <= maxLeafSize) return;
+			mid = first + count / 2;
+		}
+		else
+		{
+			const float area = bounds.SurfaceArea();
+			const float splitCost = traversalCost + intersectionCost * bestCost / (area > 0 ? area : 1.0f);
+			const float leafCost = intersectionCost * count;
+			if (splitCost >= leafCost && count <= maxLeafSize) return;
+
+			const float lo = centerBounds.lower[bestAxis];
+			const float extent = centerBounds.upper[bestAxis] - lo;
+			mid = int(std::partition(indices.begin() + first, indices.begin() + first + count, [&](int prim) {
+				return BinIndex(centers[prim][bestAxis], lo, extent) < bestSplit;
+			}) - indices.begin());
+		}
+
+		const int left = int(nodes.size());
+		nodes.push_back(Node());
+		nodes.push_back(Node());
+
+		nodes[nodeIndex].left = left;
+		nodes[nodeIndex].count = 0;
+
+		Subdivide(nodes, left, first, mid - first, depth + 1, primBounds, centers, deferBelow, subtrees);
+		Subdivide(nodes, left + 1, mid, first + count - mid, depth + 1, primBounds, centers, deferBelow, subtrees);
+	}
+
+	static int BinIndex(float center, float lo, float extent)
+	{
+		const int b = int((center - lo) / extent * binCount);
+		return glm::clamp(b, 0, binCount - 1);
+	}
+};
\ No newline at end of file
@@ -0,0 +1,847 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "stb_image_write.h"
+#include "Raytracer.h"
+#include "SceneLoader.h"
+#include "AsyncRenderer.h"
+#include "RenderCluster.h"
+
+struct BatchOptions
+{
+	int width = 1280;
+	int height = 720;
+	int samples = 1;
+	int adaptive = 0;
+	int depth = 5;
+	int threads = 0;
+	int tileSize = 16;
+	double budget = 0;
+	bool async = false;
+	int animate = 0;
+	int orbit = 0;
+	Raytracer::UpdatePolicy updatePolicy = Raytracer::UpdatePolicy::Auto;
+	float prune = 0;
+	bool roulette = false;
+	bool mipmaps = true;
+	bool linear = false;
+	bool wavefront = false;
+	std::string simd;
+	std::string mesh;
+	int instances = 0;
+	std::string scene = "default.scene";
+	bool sceneCache = true;
+	std::string output = "render.png";
+	std::string heatmap;
+	Raytracer::CostMetric costMetric = Raytracer::CostMetric::IntersectionTests;
+	std::string listen;
+	int spawn = 0;
+	int clusterTile = 64;
+	std::string worker;
+	double workerDelay = 0;
+};
+
+void PrintUsage()
+{
+	std::cout << "usage: raytracer_batch [options]\n"
+		<< "  --width <n>         image width (default 1280)\n"
+		<< "  --height <n>        image height (default 720)\n"
+		<< "  --samples <n>       samples per pixel (default 1)\n"
+		<< "  --adaptive <n>      one sample per pixel, up to n on edges; compares with n everywhere\n"
+		<< "  --depth <n>         recursion depth (default 5)\n"
+		<< "  --threads <n>       worker threads (default: all cores)\n"
+		<< "  --tile <n>          tile size in pixels (default 16)\n"
+		<< "  --progressive <ms>  accumulate samples in calls bounded by this budget\n"
+		<< "  --async             render on AsyncRenderer's thread and wait for the frame's future\n"
+		<< "  --animate <frames>  first render frames in which every sphere drifts, timing the BVH updates\n"
+		<< "  --orbit <frames>    first orbit the camera with the reprojection cache and compare to a full render\n"
+		<< "  --update <policy>   BVH update after moves: auto (refit until it degrades, default), refit or rebuild\n"
+		<< "  --linear            use the linear object scan instead of the BVH\n"
+		<< "  --wavefront         trace bounce by bounce from sorted ray queues\n"
+		<< "  --prune <weight>    cut reflection/refraction branches below this path weight\n"
+		<< "  --roulette          with --prune, keep cut branches by Russian roulette\n"
+		<< "  --no-mips           sample textures at full resolution only\n"
+		<< "  --simd <level>      packet kernels: scalar, sse or avx2 (default: widest supported)\n"
+		<< "  --scene <file>      scene file to render (default default.scene)\n"
+		<< "  --no-cache          rebuild the scene's acceleration structures instead of using <file>.cache\n"
+		<< "  --obj <file>        add a Wavefront OBJ mesh, scaled to fit beside the spheres\n"
+		<< "  --instances <n>     add n instances of the --obj mesh (or a sphere cluster) behind the spheres\n"
+		<< "  --output <file>     .png or .bmp output (default render.png)\n"
+		<< "  --heatmap <file>    also write the per-pixel cost as an image\n"
+		<< "  --heatmap-metric <m>  cost per pixel: tests (intersection tests, default), ns or samples\n"
+		<< "  --listen <address>  coordinate workers that connect to host:port or unix:/path instead of rendering\n"
+		<< "  --spawn <n>         with --listen, also start n workers on this machine\n"
+		<< "  --cluster-tile <n>  tile size handed to workers (default 64)\n"
+		<< "  --worker <address>  render tiles for the coordinator at address, with its options\n"
+		<< "  --worker-delay <ms> as a worker, wait this long before each tile\n";
+}
+
+bool ParseOptions(int argc, char** argv, BatchOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--width" && hasValue) options.width = std::atoi(argv[++i]);
+		else if (arg == "--height" && hasValue) options.height = std::atoi(argv[++i]);
+		else if (arg == "--samples" && hasValue) options.samples = std::atoi(argv[++i]);
+		else if (arg == "--adaptive" && hasValue) options.adaptive = std::atoi(argv[++i]);
+		else if (arg == "--depth" && hasValue) options.depth = std::atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue) options.threads = std::atoi(argv[++i]);
+		else if (arg == "--tile" && hasValue) options.tileSize = std::atoi(argv[++i]);
+		else if (arg == "--progressive" && hasValue) options.budget = std::atof(argv[++i]) / 1000.0;
+		else if (arg == "--output" && hasValue) options.output = argv[++i];
+		else if (arg == "--async") options.async = true;
+		else if (arg == "--animate" && hasValue) options.animate = std::atoi(argv[++i]);
+		else if (arg == "--orbit" && hasValue) options.orbit = std::atoi(argv[++i]);
+		else if (arg == "--update" && hasValue)
+		{
+			const std::string policy = argv[++i];
+			if (policy == "auto") options.updatePolicy = Raytracer::UpdatePolicy::Auto;
+			else if (policy == "refit") options.updatePolicy = Raytracer::UpdatePolicy::Refit;
+			else if (policy == "rebuild") options.updatePolicy = Raytracer::UpdatePolicy::Rebuild;
+			else return false;
+		}
+		else if (arg == "--linear") options.linear = true;
+		else if (arg == "--wavefront") options.wavefront = true;
+		else if (arg == "--prune" && hasValue) options.prune = float(std::atof(argv[++i]));
+		else if (arg == "--roulette") options.roulette = true;
+		else if (arg == "--no-mips") options.mipmaps = false;
+		else if (arg == "--simd" && hasValue) options.simd = argv[++i];
+		else if (arg == "--obj" && hasValue) options.mesh = argv[++i];
+		else if (arg == "--instances" && hasValue) options.instances = std::atoi(argv[++i]);
+		else if (arg == "--scene" && hasValue) options.scene = argv[++i];
+		else if (arg == "--no-cache") options.sceneCache = false;
+		else if (arg == "--heatmap" && hasValue) options.heatmap = argv[++i];
+		else if (arg == "--heatmap-metric" && hasValue)
+		{
+			const std::string metric = argv[++i];
+			if (metric == "tests") options.costMetric = Raytracer::CostMetric::IntersectionTests;
+			else if (metric == "ns") options.costMetric = Raytracer::CostMetric::Nanoseconds;
+			else if (metric == "samples") options.costMetric = Raytracer::CostMetric::PrimaryRays;
+			else return false;
+		}
+		else if (arg == "--listen" && hasValue) options.listen = argv[++i];
+		else if (arg == "--spawn" && hasValue) options.spawn = std::atoi(argv[++i]);
+		else if (arg == "--cluster-tile" && hasValue) options.clusterTile = std::atoi(argv[++i]);
+		else if (arg == "--worker" && hasValue) options.worker = argv[++i];
+		else if (arg == "--worker-delay" && hasValue) options.workerDelay = std::atof(argv[++i]) / 1000.0;
+		else return false;
+	}
+
+	// tests and samples are read from the trace counters, which read zero without them
+	if (!RAYTRACER_STATS && !options.heatmap.empty() && options.costMetric != Raytracer::CostMetric::Nanoseconds)
+	{
+		std::cout << "this build has no trace stats, the heatmap measures ns instead" << std::endl;
+		options.costMetric = Raytracer::CostMetric::Nanoseconds;
+	}
+
+	// workers only render whole frames of the recursive or wavefront renderer, from the scene as loaded
+	if (!options.listen.empty() && (options.budget > 0 || options.async || options.animate > 0 || options.orbit > 0)) return false;
+	if (options.spawn < 0 || options.clusterTile <= 0) return false;
+
+	if (!options.simd.empty() && options.simd != "scalar" && options.simd != "sse" && options.simd != "avx2") return false;
+
+	return options.width > 0 && options.height > 0 && options.samples > 0 && options.adaptive >= 0 && options.instances >= 0 && options.depth >= 0 && options.tileSize > 0 && options.prune >= 0;
+}
+
+SimdLevel SelectSimd(const std::string& name)
+{
+	const SimdLevel supported = DetectSimd();
+
+	SimdLevel requested = supported;
+	if (name == "scalar") requested = SimdLevel::Scalar;
+	else if (name == "sse") requested = SimdLevel::SSE;
+	else if (name == "avx2") requested = SimdLevel::AVX2;
+
+	if (int(requested) > int(supported))
+	{
+		std::cout << SimdLevelName(requested) << " is not supported here, using " << SimdLevelName(supported) << std::endl;
+		return supported;
+	}
+	return requested;
+}
+
+// Renders the frame again without pruning and reports what pruning saved and what it cost.
+void ReportPruning(Raytracer& raytracer, MemoryFramebuffer& frame, const TraceStats& stats)
+{
+	const float threshold = raytracer.pruneThreshold;
+	raytracer.pruneThreshold = 0;
+
+	MemoryFramebuffer reference(frame.width, frame.height, frame.format);
+	raytracer.Render(reference);
+	raytracer.pruneThreshold = threshold;
+
+	const TraceStats& full = raytracer.lastStats;
+
+	const size_t pixelCount = size_t(frame.width) * frame.height;
+	double squared = 0, largest = 0;
+	for (int y = 0; y < frame.height; y++)
+	{
+		for (int x = 0; x < frame.width; x++)
+		{
+			const vec3 d = glm::abs(vec3(frame.Pixel(x, y)) - vec3(reference.Pixel(x, y)));
+			squared += glm::dot(d, d) / 3;
+			largest = glm::max(largest, double(glm::max(d.x, glm::max(d.y, d.z))));
+		}
+	}
+
+	std::cout << "pruning: " << stats.prunedBranches << " branches cut, " << full.Rays() - stats.Rays() << " of " << full.Rays()
+		<< " rays saved (" << 100.0 * (full.Rays() - stats.Rays()) / glm::max(full.Rays(), uint64_t(1)) << "%)\n"
+		<< "error vs full depth: rmse " << std::sqrt(squared / pixelCount) << ", max " << largest << std::endl;
+}
+
+double RootMeanSquareError(MemoryFramebuffer& a, MemoryFramebuffer& b)
+{
+	double squared = 0;
+	for (int y = 0; y < a.height; y++)
+	{
+		for (int x = 0; x < a.width; x++)
+		{
+			const vec3 d = vec3(a.Pixel(x, y)) - vec3(b.Pixel(x, y));
+			squared += glm::dot(d, d) / 3;
+		}
+	}
+	return std::sqrt(squared / (size_t(a.width) * a.height));
+}
+
+// Where the adaptive pass spent its extra rays, and how frame compares with adaptiveSamples on
+// every pixel against one sample on every pixel, in error and in time.
+void ReportAdaptive(Raytracer& raytracer, MemoryFramebuffer& frame, double seconds)
+{
+	const Raytracer::AdaptiveReport report = raytracer.lastAdaptive;
+	const int samples = raytracer.adaptiveSamples;
+	const size_t pixelCount = size_t(frame.width) * frame.height;
+
+	static const char* reasons[] = { "prim", "normal", "contrast" };
+	int refined = 0;
+	uint64_t extraRays = 0;
+	std::cout << "adaptive:";
+	for (int k = 0; k < Raytracer::EdgeReasonCount; k++)
+	{
+		std::cout << (k ? ", " : " ") << reasons[k] << " edges " << report.pixels[k] << " pixels / " << report.extraRays[k] << " rays";
+		refined += report.pixels[k];
+		extraRays += report.extraRays[k];
+	}
+	std::cout << "\nadaptive: " << refined << " pixels refined (" << 100.0 * refined / pixelCount << "%), " << report.fullySampled
+		<< " to " << samples << " samples; " << extraRays << " extra rays (" << 100.0 * extraRays / pixelCount << "% of one per pixel)\n";
+
+	auto render = [&](int spp, MemoryFramebuffer& target) {
+		raytracer.adaptiveSamples = 0;
+		raytracer.samplesPerPixel = spp;
+
+		const auto start = std::chrono::steady_clock::now();
+		raytracer.Render(target);
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	MemoryFramebuffer single(frame.width, frame.height, frame.format), reference(frame.width, frame.height, frame.format);
+	const double singleSeconds = render(1, single);
+	const double referenceSeconds = render(samples, reference);
+
+	raytracer.adaptiveSamples = samples;
+	raytracer.samplesPerPixel = 1;
+
+	std::cout << "error vs " << samples << " spp: rmse " << RootMeanSquareError(frame, reference) << " (1 spp: " << RootMeanSquareError(single, reference)
+		<< "); time " << seconds / singleSeconds << "x of 1 spp (" << samples << " spp: " << referenceSeconds / singleSeconds << "x)" << std::endl;
+}
+
+// Mapped textures only read the tiles that were sampled; decoded ones are resident in full.
+void ReportTextures(Raytracer& raytracer)
+{
+	std::vector<const Texture*> textures;
+	auto add = [&](const Texture* texture) {
+		if (texture && std::find(textures.begin(), textures.end(), texture) == textures.end()) textures.push_back(texture);
+	};
+
+	for (auto& material : raytracer.materials)
+	{
+		add(material.ambTexture.get());
+		add(material.diffTexture.get());
+	}
+	for (auto& face : raytracer.environment.faces) add(face.get());
+
+	int mapped = 0, touched = 0, total = 0;
+	for (const Texture* texture : textures)
+	{
+		if (!texture->IsMapped()) continue;
+
+		mapped++;
+		touched += texture->TouchedTiles();
+		total += texture->TileCount();
+	}
+
+	std::cout << "textures: " << mapped << " of " << textures.size() << " mapped";
+	if (mapped > 0)
+	{
+		const double tileKB = Texture::tileSize * Texture::tileSize * 4 / 1024.0;
+		std::cout << ", " << touched << " of " << total << " tiles touched (" << touched * tileKB << " of " << total * tileKB << " KB)";
+	}
+	std::cout << std::endl;
+}
+
+// Moves every sphere and sphere set one step along a direction of its own before each frame, and
+// reports what keeping the BVH up to date cost next to the render. The scene is restored after.
+void Animate(Raytracer& raytracer, MemoryFramebuffer& frame, int frames)
+{
+	std::vector<size_t> moving;
+	std::vector<vec3> steps;
+	std::vector<std::shared_ptr<Object>> original; // unmoved copies of the moving objects
+	for (size_t i = 0; i < raytracer.objects.size(); i++)
+	{
+		Object* object = raytracer.objects[i].get();
+		if (!dynamic_cast<Sphere*>(object) && !dynamic_cast<SphereSet*>(object)) continue;
+
+		vec3 direction;
+		for (int k = 0; k < 3; k++) direction[k] = Raytracer::Hash(uint32_t(i * 3 + k)) / 4294967296.0f * 2 - 1;
+
+		moving.push_back(i);
+		steps.push_back(glm::normalize(direction) * 0.05f);
+
+		if (auto sphere = dynamic_cast<Sphere*>(object)) original.push_back(std::make_shared<Sphere>(*sphere));
+		else original.push_back(std::make_shared<SphereSet>(*static_cast<SphereSet*>(object)));
+	}
+	const BVH originalBVH = raytracer.bvh;
+
+	double updateSeconds = 0, renderSeconds = 0;
+	int rebuilds = 0;
+	for (int f = 0; f < frames; f++)
+	{
+		for (size_t k = 0; k < moving.size(); k++) raytracer.MoveObject(moving[k], steps[k]);
+		raytracer.UpdateScene();
+
+		const auto start = std::chrono::steady_clock::now();
+		raytracer.Render(frame);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		const Raytracer::SceneUpdate& update = raytracer.lastUpdate;
+		std::cout << "frame " << f << ": " << update.moved << " moved, " << (update.rebuilt ? "rebuilt" : "refitted")
+			<< " in " << update.seconds * 1000 << " ms (SAH cost x" << update.costRatio << "), rendered in " << seconds * 1000 << " ms\n";
+
+		updateSeconds += update.seconds;
+		renderSeconds += seconds;
+		rebuilds += update.rebuilt;
+	}
+
+	// the main render shows the scene as it was loaded
+	for (size_t k = 0; k < moving.size(); k++) raytracer.objects[moving[k]] = original[k];
+	raytracer.bvh = originalBVH;
+	raytracer.BuildScene(false);
+
+	std::cout << "animation: " << frames << " frames, " << rebuilds << " rebuilds, updates " << updateSeconds * 1000 << " ms, renders "
+		<< renderSeconds * 1000 << " ms" << std::endl;
+}
+
+// Turns the camera a quarter degree per frame around the point 3.75 units ahead of it, rendering
+// through the reprojection cache, and compares the last frame with a full render. The camera is
+// put back after.
+void Orbit(Raytracer& raytracer, int frames)
+{
+	MemoryFramebuffer frame(raytracer.width, raytracer.height, PixelFormat::RGBA8);
+	Camera& camera = raytracer.camera;
+	const Camera initial = camera;
+	const vec3 target = camera.position + camera.forward * 3.75f;
+	const float step = glm::radians(0.25f);
+
+	raytracer.InvalidateReprojection();
+
+	double seconds = 0;
+	float retraced = 0;
+	uint64_t rays = 0;
+	for (int f = 0; f <= frames; f++)
+	{
+		if (f > 0)
+		{
+			const vec3 offset = camera.position - target;
+			camera.position = target + vec3(offset.x * std::cos(step) + offset.z * std::sin(step), offset.y, offset.z * std::cos(step) - offset.x * std::sin(step));
+			camera.LookAt(target);
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		raytracer.RenderReprojected(frame);
+		const double frameSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "frame " << f << ": " << raytracer.lastRetraceRatio * 100 << "% shaded again, " << raytracer.lastStats.Rays() << " rays, "
+			<< frameSeconds * 1000 << " ms\n";
+		if (f == 0) continue;
+
+		seconds += frameSeconds;
+		retraced += raytracer.lastRetraceRatio;
+		rays += raytracer.lastStats.Rays();
+	}
+
+	MemoryFramebuffer reference(raytracer.width, raytracer.height, PixelFormat::RGBA8);
+	const auto start = std::chrono::steady_clock::now();
+	raytracer.Render(reference);
+	const double fullSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	double squared = 0, largest = 0;
+	for (int y = 0; y < frame.height; y++)
+	{
+		for (int x = 0; x < frame.width; x++)
+		{
+			const vec3 d = glm::abs(vec3(frame.Pixel(x, y)) - vec3(reference.Pixel(x, y)));
+			squared += glm::dot(d, d) / 3;
+			largest = glm::max(largest, double(glm::max(d.x, glm::max(d.y, d.z))));
+		}
+	}
+
+	std::cout << "orbit: " << frames << " moves, per frame " << retraced / glm::max(frames, 1) * 100 << "% shaded again, "
+		<< rays / glm::max(frames, 1) << " rays, " << seconds / glm::max(frames, 1) * 1000 << " ms; full render "
+		<< raytracer.lastStats.Rays() << " rays, " << fullSeconds * 1000 << " ms\n"
+		<< "last frame vs full render: rmse " << std::sqrt(squared / (frame.width * frame.height)) << ", max " << largest << std::endl;
+
+	// the main render shows the view as it was set up
+	camera = initial;
+	raytracer.InvalidateReprojection();
+}
+
+// The frame is already packed RGBA8, so its bytes are written as they are.
+bool WriteImage(const std::string& filename, const MemoryFramebuffer& frame)
+{
+	const size_t dot = filename.find_last_of('.');
+	const std::string ext = dot == std::string::npos ? "" : filename.substr(dot);
+
+	if (ext == ".bmp") return stbi_write_bmp(filename.c_str(), frame.width, frame.height, 4, frame.bytes.data()) != 0;
+	return stbi_write_png(filename.c_str(), frame.width, frame.height, 4, frame.bytes.data(), int(frame.Pitch())) != 0;
+}
+
+// Black through blue, red and yellow to white, scaled so the 99th percentile is white; a few
+// extreme pixels would otherwise leave the rest of the image dark.
+bool WriteHeatmap(const std::string& filename, int width, int height, const std::vector<float>& costs)
+{
+	std::vector<float> sorted(costs);
+	std::sort(sorted.begin(), sorted.end());
+	const float top = glm::max(sorted[size_t(double(sorted.size() - 1) * 0.99)], 1e-6f);
+
+	double total = 0;
+	for (float cost : costs) total += cost;
+	std::cout << "heatmap: mean " << total / costs.size() << ", 99th percentile " << top << ", max " << sorted.back() << std::endl;
+
+	static const vec3 ramp[] = { vec3(0), vec3(0, 0, 1), vec3(1, 0, 0), vec3(1, 1, 0), vec3(1) };
+	const int segments = int(sizeof(ramp) / sizeof(ramp[0])) - 1;
+
+	MemoryFramebuffer frame(width, height, PixelFormat::RGBA8);
+	const FramebufferView view = frame.View();
+	for (size_t i = 0; i < costs.size(); i++)
+	{
+		const float x = glm::clamp(costs[i] / top, 0.0f, 1.0f) * segments;
+		const int segment = glm::min(int(x), segments - 1);
+		const float t = x - segment;
+		view.Store(int(i % width), int(i / width), vec4(ramp[segment] * (1 - t) + ramp[segment + 1] * t, 1));
+	}
+
+	return WriteImage(filename, frame);
+}
+
+void ApplyOptions(const BatchOptions& options, Raytracer& raytracer)
+{
+	raytracer.samplesPerPixel = options.samples;
+	raytracer.adaptiveSamples = options.adaptive;
+	raytracer.maxDepth = options.depth;
+	raytracer.useBVH = !options.linear;
+	raytracer.wavefront = options.wavefront;
+	raytracer.pruneThreshold = options.prune;
+	raytracer.russianRoulette = options.roulette;
+	raytracer.mipmapping = options.mipmaps;
+	raytracer.threadCount = options.threads;
+	raytracer.tileSize = options.tileSize;
+	raytracer.simdLevel = SelectSimd(options.simd);
+	raytracer.usePackets = raytracer.simdLevel != SimdLevel::Scalar;
+	if (!options.heatmap.empty()) raytracer.costMetric = options.costMetric;
+}
+
+template<typename T>
+size_t VectorBytes(const std::vector<T>& values)
+{
+	return values.size() * sizeof(T);
+}
+
+// Bytes of the buffers and BVH an instance shares instead of copying.
+size_t GeometryBytes(const Object& geometry)
+{
+	if (auto mesh = dynamic_cast<const TriangleMesh*>(&geometry))
+		return VectorBytes(mesh->positions) + VectorBytes(mesh->uvs) + VectorBytes(mesh->indices) + VectorBytes(mesh->records) + VectorBytes(mesh->bvh.nodes) + VectorBytes(mesh->bvh.indices);
+
+	if (auto set = dynamic_cast<const SphereSet*>(&geometry))
+		return VectorBytes(set->cx) * 4 + VectorBytes(set->ids) + VectorBytes(set->bvh.nodes) + VectorBytes(set->bvh.indices);
+
+	return sizeof(geometry);
+}
+
+// A grid of instances on the ground behind the spheres, each turned and sized at random, every
+// other one in a material of its own.
+void AddInstances(int count, std::shared_ptr<Object> geometry, Raytracer& raytracer)
+{
+	const int side = int(glm::ceil(glm::sqrt(float(count))));
+	const float spacing = 16.0f / side;
+
+	Material painted(vec3(0.2f, 0.4f, 0.9f));
+	painted.diff = vec3(0.0f);
+	painted.spec = vec3(0.0f);
+	painted.alpha = 20.0f;
+
+	for (int i = 0; i < count; i++)
+	{
+		const float angle = Raytracer::Hash(uint32_t(i * 2)) / 4294967296.0f * 6.2831853f;
+		const float size = spacing * (0.5f + 0.3f * Raytracer::Hash(uint32_t(i * 2 + 1)) / 4294967296.0f);
+		const vec3 position((i % side + 0.5f) * spacing - 8.0f, -1.5f + size * 0.5f, (i / side + 0.5f) * spacing + 3.0f);
+
+		mat4 transform = glm::translate(mat4(1), position);
+		transform = glm::rotate(transform, angle, vec3(0, 1, 0));
+		transform = glm::scale(transform, vec3(size));
+
+		auto instance = std::make_shared<Instance>(geometry, transform);
+		if (i % 2 == 1)
+		{
+			instance->material = painted;
+			instance->overrideMaterial = true;
+		}
+		raytracer.objects.push_back(instance);
+	}
+
+	const size_t shared = GeometryBytes(*geometry);
+	std::cout << "instances: " << count << ", " << shared / 1024 << " KB of shared geometry and " << count * sizeof(Instance) / 1024
+		<< " KB of instances (" << count * shared / (1024 * 1024) << " MB as copies)" << std::endl;
+}
+
+// The --obj mesh, fitted to where AddMesh puts it; nullptr if it cannot be read.
+std::shared_ptr<TriangleMesh> LoadMesh(const BatchOptions& options)
+{
+	auto mesh = TriangleMesh::LoadObj(options.mesh);
+	if (!mesh) return nullptr;
+
+	std::cout << options.mesh << ": " << mesh->TriangleCount() << " triangles, " << mesh->positions.size() << " vertices\n";
+
+	if (options.instances > 0) mesh->Fit(vec3(0.0f), 1.0f);
+	else mesh->Fit(vec3(2.2f, -0.6f, 2.5f), 1.8f);
+	return mesh;
+}
+
+// Adds mesh, from LoadMesh or the cluster job, beside the spheres or as --instances instances.
+// Without a mesh the instances are of a sphere cluster.
+void AddMesh(const BatchOptions& options, std::shared_ptr<TriangleMesh> mesh, Raytracer& raytracer)
+{
+	if (!mesh && options.instances == 0) return;
+
+	if (!mesh)
+	{
+		// a unit-sized cluster of spheres
+		std::vector<vec3> centers;
+		std::vector<float> radii;
+		for (uint32_t i = 0; i < 64; i++)
+		{
+			vec3 p;
+			for (int k = 0; k < 3; k++) p[k] = Raytracer::Hash(i * 3 + k + 1000) / 4294967296.0f - 0.5f;
+			centers.push_back(p * 0.8f);
+			radii.push_back(0.1f);
+		}
+
+		auto cluster = std::make_shared<SphereSet>(centers, radii, vec3(0.9f, 0.3f, 0.2f));
+		cluster->material.diff = vec3(0.0f);
+		cluster->material.spec = vec3(0.0f);
+		cluster->material.alpha = 20.0f;
+
+		AddInstances(options.instances, cluster, raytracer);
+		raytracer.BuildScene();
+		return;
+	}
+
+	mesh->material = Material(vec3(0.8f, 0.7f, 0.3f));
+	mesh->material.diff = vec3(0.0f);
+	mesh->material.spec = vec3(0.0f);
+	mesh->material.reflection = 0.2f;
+
+	if (options.instances > 0) AddInstances(options.instances, mesh, raytracer);
+	else raytracer.objects.push_back(mesh);
+	raytracer.BuildScene();
+}
+
+// A cluster job: the number of coordinator arguments, the arguments and the packed scene, each a
+// uint64 size followed by its bytes.
+std::string EncodeJob(const std::vector<std::string>& args, const std::string& scene)
+{
+	std::string job;
+	auto append = [&](const std::string& value) {
+		const uint64_t size = value.size();
+		job.append(reinterpret_cast<const char*>(&size), sizeof(size));
+		job += value;
+	};
+
+	append(std::to_string(args.size()));
+	for (auto& arg : args) append(arg);
+	append(scene);
+	return job;
+}
+
+bool DecodeJob(const std::string& job, std::vector<std::string>& args, std::string& scene)
+{
+	size_t offset = 0;
+	auto next = [&](std::string& value) {
+		uint64_t size;
+		if (job.size() - offset < sizeof(size)) return false;
+		memcpy(&size, job.data() + offset, sizeof(size));
+		offset += sizeof(size);
+
+		if (job.size() - offset < size) return false;
+		value = job.substr(offset, size_t(size));
+		offset += size_t(size);
+		return true;
+	};
+
+	std::string count;
+	if (!next(count)) return false;
+
+	// every argument takes at least its size, so a larger count cannot be honest
+	const unsigned long long argCount = std::strtoull(count.c_str(), nullptr, 10);
+	if (argCount > (job.size() - offset) / sizeof(uint64_t)) return false;
+
+	args.resize(size_t(argCount));
+	for (auto& arg : args)
+	{
+		if (!next(arg)) return false;
+	}
+	return next(scene);
+}
+
+// The coordinator's Raytracer, set up from its job with this machine's thread count.
+std::unique_ptr<Raytracer> SetupWorker(const BatchOptions& local, const std::string& job)
+{
+	std::vector<std::string> args;
+	std::string scene;
+	if (!DecodeJob(job, args, scene)) return nullptr;
+
+	std::vector<char*> argv{ const_cast<char*>("raytracer_batch") };
+	for (auto& arg : args) argv.push_back(&arg[0]);
+
+	BatchOptions options;
+	if (!ParseOptions(int(argv.size()), argv.data(), options)) return nullptr;
+	options.threads = local.threads;
+
+	auto raytracer = std::make_unique<Raytracer>(options.width, options.height);
+	ApplyOptions(options, *raytracer);
+
+	// the --obj mesh comes with the scene, the textures must match the coordinator's
+	SceneLoader loader;
+	std::vector<std::shared_ptr<TriangleMesh>> meshes;
+	if (!loader.Unpack(scene, *raytracer, &meshes) || meshes.size() != (options.mesh.empty() ? 0 : 1)) return nullptr;
+	AddMesh(options, meshes.empty() ? nullptr : meshes[0], *raytracer);
+
+	return raytracer;
+}
+
+int RunWorker(const BatchOptions& options)
+{
+	RenderWorker worker;
+	worker.tileDelay = options.workerDelay;
+
+	const bool done = worker.Run(options.worker, [&](const std::string& job) { return SetupWorker(options, job); });
+	std::cout << "worker: " << worker.tilesRendered << " tiles rendered" << (done ? "" : ", frame not finished") << std::endl;
+	return done ? 0 : 1;
+}
+
+// Starts the local workers asked for, then hands out tiles until the frame is assembled.
+bool RenderOnCluster(RenderCoordinator& coordinator, const BatchOptions& options, const char* program, const std::string& job, MemoryFramebuffer& frame)
+{
+	coordinator.tileSize = options.clusterTile;
+	if (!coordinator.Listen(options.listen)) return false;
+
+	std::vector<pid_t> workers;
+	const std::string threads = std::to_string(options.threads);
+	for (int i = 0; i < options.spawn; i++)
+	{
+		const pid_t pid = fork();
+		if (pid == 0)
+		{
+			execl(program, program, "--worker", options.listen.c_str(), "--threads", threads.c_str(), static_cast<char*>(nullptr));
+			_exit(127);
+		}
+		if (pid > 0) workers.push_back(pid);
+	}
+
+	std::cout << "cluster: listening on " << options.listen << ", " << workers.size() << " local workers started" << std::endl;
+	const bool rendered = coordinator.Render(job, frame);
+
+	for (pid_t pid : workers) waitpid(pid, nullptr, 0);
+	return rendered;
+}
+
+void ReportCluster(const RenderCoordinator& coordinator)
+{
+	const RenderCoordinator::Report& report = coordinator.lastReport;
+
+	std::cout << "cluster: " << report.tiles << " tiles in " << report.seconds * 1000 << " ms, " << report.redispatched << " sent again, "
+		<< report.duplicates << " duplicate results discarded\n";
+	for (size_t i = 0; i < report.workers.size(); i++)
+	{
+		const RenderCoordinator::WorkerReport& worker = report.workers[i];
+		std::cout << "worker " << i << ": " << worker.tiles << " tiles, busy " << worker.busy * 1000 << " ms" << (worker.lost ? ", lost" : "") << "\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	BatchOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (!options.worker.empty()) return RunWorker(options);
+
+	const auto setupStart = std::chrono::steady_clock::now();
+	Raytracer raytracer(options.width, options.height);
+	ApplyOptions(options, raytracer);
+
+	SceneLoader loader;
+	loader.useCache = options.sceneCache;
+	if (!loader.Load(options.scene, raytracer)) return 1;
+	const double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
+
+	std::cout << options.scene << ": " << raytracer.objects.size() << " objects, loaded in " << setupSeconds * 1000 << " ms"
+		<< (!options.sceneCache ? "" : loader.cacheHit ? " from cache" : ", cache written") << std::endl;
+
+	std::vector<std::shared_ptr<TriangleMesh>> meshes;
+	if (!options.mesh.empty())
+	{
+		auto mesh = LoadMesh(options);
+		if (!mesh) return 1;
+		meshes.push_back(mesh);
+	}
+
+	std::string packedScene;
+	if (!options.listen.empty()) packedScene = loader.Pack(raytracer, meshes);
+
+	AddMesh(options, meshes.empty() ? nullptr : meshes[0], raytracer);
+
+	// written to the image file as is
+	MemoryFramebuffer frame(options.width, options.height, PixelFormat::RGBA8);
+
+	raytracer.updatePolicy = options.updatePolicy;
+	if (options.animate > 0) Animate(raytracer, frame, options.animate);
+	if (options.orbit > 0) Orbit(raytracer, options.orbit);
+
+	const auto start = std::chrono::steady_clock::now();
+	TraceStats stats;
+
+	RenderCoordinator coordinator;
+
+	if (!options.listen.empty())
+	{
+		std::vector<std::string> args(argv + 1, argv + argc);
+		if (!RenderOnCluster(coordinator, options, argv[0], EncodeJob(args, packedScene), frame)) return 1;
+		stats = coordinator.lastReport.stats;
+	}
+	else if (options.async)
+	{
+		AsyncRenderer renderer(raytracer, 2, frame.format);
+
+		AsyncRenderer::FrameJob job;
+		job.setup = [&](Raytracer& r) { r.maxProgressiveSamples = options.samples; };
+		job.progressive = options.budget > 0;
+		job.budget = options.budget;
+
+		const AsyncRenderer::FrameResult result = renderer.Submit(job).get();
+		stats = result.stats;
+
+		uint64_t published = 0;
+		CopyPixels(renderer.Present(published)->Lock(), frame.View());
+
+		std::cout << "async: " << result.frame << " frames published in " << result.seconds * 1000 << " ms\n";
+	}
+	else if (options.budget > 0)
+	{
+		raytracer.maxProgressiveSamples = options.samples;
+		raytracer.ResetProgressive();
+
+		int calls = 0;
+		double longestCall = 0;
+		while (!raytracer.ProgressiveConverged())
+		{
+			const auto callStart = std::chrono::steady_clock::now();
+			raytracer.RenderProgressive(frame, options.budget);
+			longestCall = glm::max(longestCall, std::chrono::duration<double>(std::chrono::steady_clock::now() - callStart).count());
+
+			stats += raytracer.lastStats;
+			calls++;
+		}
+
+		std::cout << "progressive: " << calls << " calls, longest " << longestCall * 1000 << " ms (budget " << options.budget * 1000 << " ms)\n";
+	}
+	else
+	{
+		raytracer.Render(frame);
+		stats = raytracer.lastStats;
+	}
+
+	const auto end = std::chrono::steady_clock::now();
+
+	const double seconds = std::chrono::duration<double>(end - start).count();
+
+	std::cout << options.width << "x" << options.height
+		<< ", " << options.samples << " spp, depth " << options.depth;
+	if (options.listen.empty()) std::cout << ", " << raytracer.scheduler->ThreadCount() << " threads, " << options.tileSize << "px tiles";
+	else std::cout << ", " << coordinator.lastReport.workers.size() << " workers, " << options.clusterTile << "px tiles";
+	std::cout << ", " << SimdLevelName(raytracer.simdLevel) << " packets\n"
+		<< "scene setup: " << setupSeconds * 1000 << " ms\n"
+		<< "time: " << seconds << " s\n"
+		<< "rays: " << stats.Rays() << " (" << stats.primaryRays << " primary, " << stats.shadowRays << " shadow, "
+		<< stats.reflectionRays << " reflection, " << stats.refractionRays << " refraction)\n"
+		<< "rays/s: " << stats.Rays() / seconds << "\n"
+		<< "BVH nodes visited: " << stats.nodeVisits << ", intersection tests: " << stats.intersectionTests
+		<< ", texture fetches: " << stats.textureFetches << "\n"
+		<< "shadow queries: " << stats.shadowQueries << ", " << stats.shadowEarlyExits << " ended early ("
+		<< stats.shadowCacheHits << " on the cached occluder)" << std::endl;
+
+	if (options.wavefront && options.budget <= 0)
+	{
+		std::cout << "wavefront queues:";
+		for (size_t size : raytracer.lastQueueSizes) std::cout << " " << size;
+		std::cout << std::endl;
+	}
+
+	if (options.listen.empty()) ReportTextures(raytracer);
+
+	if (options.listen.empty())
+	{
+		const auto& threads = raytracer.scheduler->stats;
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			std::cout << "thread " << i << ": busy " << threads[i].busy * 1000 << " ms, idle " << threads[i].idle * 1000
+				<< " ms, " << threads[i].tiles << " tiles, " << threads[i].steals << " stolen\n";
+		}
+	}
+	else ReportCluster(coordinator);
+
+	// before ReportPruning renders again
+	if (!options.heatmap.empty())
+	{
+		if (raytracer.costBuffer.empty()) std::cout << "no heatmap: costs are only recorded by the recursive renderer" << std::endl;
+		else if (!WriteHeatmap(options.heatmap, options.width, options.height, raytracer.costBuffer))
+		{
+			std::cout << "Failed to write " << options.heatmap << std::endl;
+			return 1;
+		}
+	}
+
+	if (options.prune > 0 && options.budget <= 0) ReportPruning(raytracer, frame, stats);
+	if (raytracer.Adaptive() && !options.wavefront && options.budget <= 0 && options.listen.empty()) ReportAdaptive(raytracer, frame, seconds);
+
+	if (!WriteImage(options.output, frame))
+	{
+		std::cout << "Failed to write " << options.output << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,347 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "Raytracer.h"
+#include "SceneLoader.h"
+
+// Microbenchmarks of the hot kernels. Every data set is generated from fixed seeds, so runs on
+// different builds measure the same work; results are written as JSON.
+
+struct BenchmarkOptions
+{
+	double minTime = 0.2;
+	int repetitions = 5;
+	std::string filter;
+	std::string output;
+};
+
+struct BenchmarkResult
+{
+	std::string name;
+	uint64_t iterations;
+	double nsPerOp;
+	double raysPerSecond;
+};
+
+// Uniform floats from a hashed counter; unlike <random> distributions the sequence is the same everywhere.
+class BenchmarkRandom
+{
+public:
+	BenchmarkRandom(uint32_t seed) : state(seed)
+	{
+	}
+
+	float Next()
+	{
+		return (Raytracer::Hash(state++) >> 8) / 16777216.0f;
+	}
+
+	float Next(float lower, float upper)
+	{
+		return lower + (upper - lower) * Next();
+	}
+
+	vec3 NextVec3(const vec3& lower, const vec3& upper)
+	{
+		const float x = Next(lower.x, upper.x);
+		const float y = Next(lower.y, upper.y);
+		const float z = Next(lower.z, upper.z);
+		return vec3(x, y, z);
+	}
+
+	vec3 NextDirection()
+	{
+		vec3 d;
+		do d = NextVec3(vec3(-1), vec3(1)); while (glm::dot(d, d) > 1 || glm::dot(d, d) < 1e-4f);
+		return glm::normalize(d);
+	}
+
+private:
+	uint32_t state;
+};
+
+// Keeps results alive so the measured calls cannot be optimized away.
+static volatile float benchmarkSink;
+
+class BenchmarkRunner
+{
+public:
+	BenchmarkOptions options;
+	std::vector<BenchmarkResult> results;
+
+	// op(i) runs operation i of a cycle of the data set and returns a value that depends on its
+	// result. raysPerOp converts operations per second into rays per second.
+	template<typename Op>
+	void Run(const std::string& name, double raysPerOp, Op op)
+	{
+		if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+
+		// grow the batch until one takes minTime, then time that batch repeatedly
+		uint64_t iterations = 1;
+		double seconds = 0;
+		while ((seconds = Time(iterations, op)) < options.minTime && iterations < (uint64_t(1) << 40))
+		{
+			const double scale = seconds > 0 ? options.minTime * 1.2 / seconds : 10;
+			iterations = uint64_t(double(iterations) * glm::clamp(scale, 2.0, 10.0));
+		}
+
+		std::vector<double> samples(glm::max(options.repetitions, 1));
+		for (auto& sample : samples) sample = Time(iterations, op) / double(iterations);
+
+		std::sort(samples.begin(), samples.end());
+		const double median = samples[samples.size() / 2];
+
+		results.push_back(BenchmarkResult{ name, iterations, median * 1e9, raysPerOp / median });
+		std::cerr << name << ": " << median * 1e9 << " ns/op" << std::endl;
+	}
+
+private:
+	template<typename Op>
+	double Time(uint64_t iterations, Op& op)
+	{
+		float sum = 0;
+
+		const auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < iterations; i++) sum += op(i);
+		const auto end = std::chrono::steady_clock::now();
+
+		benchmarkSink = sum;
+		return std::chrono::duration<double>(end - start).count();
+	}
+};
+
+std::vector<Ray> MakeRays(int count, const vec3& lower, const vec3& upper, const vec3& target, float targetSpread, uint32_t seed)
+{
+	BenchmarkRandom random(seed);
+
+	std::vector<Ray> rays(count);
+	for (auto& ray : rays)
+	{
+		const vec3 start = random.NextVec3(lower, upper);
+		const vec3 aim = target + random.NextDirection() * targetSpread;
+		ray = Ray{ start, glm::normalize(aim - start) };
+	}
+	return rays;
+}
+
+void BenchmarkPrimitives(BenchmarkRunner& runner)
+{
+	// about half of the rays hit each primitive
+	std::vector<Ray> rays = MakeRays(1024, vec3(-4, -4, -8), vec3(4, 4, -6), vec3(0), 1.5f, 1);
+	const size_t mask = rays.size() - 1;
+
+	Sphere sphere(vec3(0), 1);
+	runner.Run("Sphere::CheckRayCollision", 1, [&](uint64_t i) {
+		return sphere.CheckRayCollision(rays[i & mask]).d;
+	});
+
+	const TriangleRecord triangle(vec3(-1, -1, 0), vec3(0, 1, 0), vec3(1, -1, 0));
+	runner.Run("TriangleRecord::Intersect", 1, [&](uint64_t i) {
+		float t = 0, w1, w2;
+		return triangle.Intersect(rays[i & mask], t, w1, w2) ? t : -1.0f;
+	});
+
+	Square square(vec3(-1, 1, 0), vec3(1, 1, 0), vec3(1, -1, 0), vec3(-1, -1, 0), vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(0, 1));
+	runner.Run("Square::CheckRayCollision", 1, [&](uint64_t i) {
+		return square.CheckRayCollision(rays[i & mask]).d;
+	});
+}
+
+void BenchmarkTextures(BenchmarkRunner& runner)
+{
+	const int size = 512;
+	BenchmarkRandom random(2);
+
+	std::vector<vec3> pixels(size * size);
+	for (auto& pixel : pixels) pixel = random.NextVec3(vec3(0), vec3(1));
+	Texture texture(size, size, pixels);
+
+	std::vector<vec2> uvs(4096);
+	for (auto& uv : uvs) uv = vec2(random.Next(-1, 2), random.Next(-1, 2));
+	const size_t mask = uvs.size() - 1;
+
+	runner.Run("Texture::SampleLinear", 0, [&](uint64_t i) {
+		return texture.SampleLinear(uvs[i & mask]).x;
+	});
+
+	runner.Run("Texture::SamplePoint", 0, [&](uint64_t i) {
+		return texture.SamplePoint(uvs[i & mask]).x;
+	});
+
+	runner.Run("Texture::Sample/trilinear", 0, [&](uint64_t i) {
+		return texture.Sample(uvs[i & mask], 4.0f / size).x;
+	});
+}
+
+void BenchmarkScenes(BenchmarkRunner& runner, int width, int height)
+{
+	std::vector<Ray> rays = MakeRays(4096, vec3(-1, -1, -2), vec3(1, 1, -1.5f), vec3(0, 0, 5), 4, 3);
+	const size_t mask = rays.size() - 1;
+
+	for (int count : { 16, 256, 4096 })
+	{
+		Raytracer raytracer(width, height);
+
+		BenchmarkRandom random(4);
+		for (int i = 0; i < count; i++)
+		{
+			const float radius = 2.0f / glm::pow(float(count), 1 / 3.0f) * random.Next(0.2f, 0.5f);
+			raytracer.objects.push_back(make_shared<Sphere>(random.NextVec3(vec3(-4, -4, 1), vec3(4, 4, 9)), radius));
+		}
+		raytracer.BuildScene();
+
+		for (bool bvh : { true, false })
+		{
+			raytracer.useBVH = bvh;
+			runner.Run("Raytracer::FindClosestCollision/" + std::string(bvh ? "bvh/" : "linear/") + std::to_string(count), 1, [&](uint64_t i) {
+				return raytracer.FindClosestCollision(rays[i & mask]).d;
+			});
+		}
+	}
+
+	// squares of random size and orientation, all facing the rays, as a scene of walls would be
+	for (int count : { 256, 4096 })
+	{
+		Raytracer raytracer(width, height);
+
+		BenchmarkRandom random(5);
+		for (int i = 0; i < count; i++)
+		{
+			const float size = 2.0f / glm::sqrt(float(count)) * random.Next(0.5f, 2.0f);
+			const vec3 center = random.NextVec3(vec3(-4, -4, 1), vec3(4, 4, 9));
+
+			vec3 a = random.NextDirection() * size;
+			vec3 b = glm::normalize(glm::cross(a, random.NextDirection())) * size;
+			if (glm::cross(a, b).z > 0) std::swap(a, b);
+
+			raytracer.objects.push_back(make_shared<Square>(center - a - b, center + a - b, center + a + b, center - a + b));
+		}
+		raytracer.BuildScene();
+
+		const std::string suffix = "squares/" + std::to_string(count);
+		runner.Run("Raytracer::FindClosestCollision/" + suffix, 1, [&](uint64_t i) {
+			return raytracer.FindClosestCollision(rays[i & mask]).d;
+		});
+
+		// rows of primary rays, one packet each (the width is a multiple of the packet width)
+		const int packetWidth = raytracer.PacketWidth();
+		std::vector<Ray> primary;
+		for (int y = 0; y < height; y += 4)
+			for (int x = 0; x < width; x++) primary.push_back(raytracer.PrimaryRay(vec2(x, y)));
+
+		const size_t packets = primary.size() / packetWidth;
+		std::vector<Hit> hits(packetWidth);
+		runner.Run("Raytracer::FindClosestCollisionPacket/" + suffix, packetWidth, [&](uint64_t i) {
+			raytracer.FindClosestCollisionPacket(&primary[(i % packets) * packetWidth], packetWidth, hits.data());
+			return hits[0].d;
+		});
+	}
+
+	// default.scene, traced recursively from its own primary rays
+	Raytracer raytracer(width, height);
+	if (!SceneLoader().Load("default.scene", raytracer)) return;
+
+	std::vector<Ray> primary;
+	for (int y = 0; y < height; y += 4)
+		for (int x = 0; x < width; x += 4) primary.push_back(raytracer.PrimaryRay(vec2(x, y)));
+
+	// traceRay leaves counting the primary ray to its caller
+	const TraceStats before = threadStats;
+	for (auto& ray : primary) raytracer.traceRay(ray, raytracer.maxDepth);
+	const double raysPerOp = 1 + double((threadStats - before).Rays()) / primary.size();
+
+	runner.Run("Raytracer::traceRay/default", raysPerOp, [&](uint64_t i) {
+		return raytracer.traceRay(primary[i % primary.size()], raytracer.maxDepth).x;
+	});
+}
+
+std::string JsonString(const std::string& s)
+{
+	std::string quoted = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\') quoted += '\\';
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+
+void WriteJson(std::ostream& out, const BenchmarkRunner& runner)
+{
+	out << "{\n  \"context\": {\n"
+		<< "    \"simd\": " << JsonString(SimdLevelName(DetectSimd())) << ",\n"
+#if defined(__VERSION__)
+		<< "    \"compiler\": " << JsonString(__VERSION__) << ",\n"
+#endif
+		<< "    \"stats\": " << (RAYTRACER_STATS ? "true" : "false") << ",\n"
+		<< "    \"min_time_s\": " << runner.options.minTime << ",\n"
+		<< "    \"repetitions\": " << runner.options.repetitions << "\n"
+		<< "  },\n  \"benchmarks\": [";
+
+	for (size_t i = 0; i < runner.results.size(); i++)
+	{
+		const BenchmarkResult& result = runner.results[i];
+
+		out << (i ? ",\n" : "\n") << "    { \"name\": " << JsonString(result.name)
+			<< ", \"iterations\": " << result.iterations
+			<< ", \"ns_per_op\": " << result.nsPerOp
+			<< ", \"ops_per_second\": " << 1e9 / result.nsPerOp;
+		if (result.raysPerSecond > 0) out << ", \"rays_per_second\": " << result.raysPerSecond;
+		out << " }";
+	}
+
+	out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv)
+{
+	BenchmarkRunner runner;
+	BenchmarkOptions& options = runner.options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--min-time" && hasValue) options.minTime = std::atof(argv[++i]) / 1000.0;
+		else if (arg == "--repetitions" && hasValue) options.repetitions = std::atoi(argv[++i]);
+		else if (arg == "--filter" && hasValue) options.filter = argv[++i];
+		else if (arg == "--output" && hasValue) options.output = argv[++i];
+		else
+		{
+			std::cout << "usage: raytracer_bench [options]\n"
+				<< "  --min-time <ms>      shortest timed batch (default 200)\n"
+				<< "  --repetitions <n>    timed batches per benchmark, the median is reported (default 5)\n"
+				<< "  --filter <text>      only run benchmarks whose name contains text\n"
+				<< "  --output <file>      write the JSON there instead of to stdout\n";
+			return 1;
+		}
+	}
+
+	int width = 640, height = 360;
+
+	BenchmarkPrimitives(runner);
+	BenchmarkTextures(runner);
+	BenchmarkScenes(runner, width, height);
+
+	if (options.output.empty())
+	{
+		WriteJson(std::cout, runner);
+		return 0;
+	}
+
+	std::ofstream out(options.output);
+	WriteJson(out, runner);
+	if (!out)
+	{
+		std::cout << "Failed to write " << options.output << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
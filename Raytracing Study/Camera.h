@@ -0,0 +1,67 @@
+#pragma once
+#include <glm/glm.hpp>
+using namespace glm;
+
+// Pinhole camera looking along forward. The screen is a rectangle two units tall, focalLength in
+// front of position; primary rays start on it, so nothing nearer than the screen is seen.
+class Camera
+{
+public:
+	vec3 position = vec3(0, 0, -1.5f);
+	vec3 forward = vec3(0, 0, 1);
+	vec3 up = vec3(0, 1, 0);
+	float focalLength = 1.5f;
+
+	// Turns the camera toward target, with up as close to worldUp as forward allows.
+	void LookAt(const vec3& target, const vec3& worldUp = vec3(0, 1, 0))
+	{
+		const vec3 direction = target - position;
+		if (glm::dot(direction, direction) <= 0) return;
+
+		forward = glm::normalize(direction);
+
+		const vec3 side = glm::cross(worldUp, forward);
+		if (glm::dot(side, side) > 1e-12f) up = glm::normalize(glm::cross(forward, side));
+	}
+
+	bool operator==(const Camera& other) const
+	{
+		return position == other.position && forward == other.forward && up == other.up && focalLength == other.focalLength;
+	}
+
+	bool operator!=(const Camera& other) const
+	{
+		return !(*this == other);
+	}
+
+	vec3 Right() const
+	{
+		return glm::cross(up, forward);
+	}
+
+	// World position of screen position pos, in pixels from the top left corner.
+	vec3 ScreenToWorld(vec2 pos, int width, int height) const
+	{
+		float x = 2.0f / width;
+		float y = 2.0f / height;
+		float aspect = (float)width / height;
+
+		return position + forward * focalLength + Right() * ((pos.x * x - 1) * aspect) + up * (-pos.y * y + 1);
+	}
+
+	// Screen position where the line from position to p crosses the screen; false when p is not
+	// in front of the camera.
+	bool WorldToScreen(const vec3& p, int width, int height, vec2& pos) const
+	{
+		const vec3 d = p - position;
+		const float depth = glm::dot(d, forward);
+		if (depth <= 0) return false;
+
+		const float aspect = (float)width / height;
+		const float sx = glm::dot(d, Right()) * focalLength / depth;
+		const float sy = glm::dot(d, up) * focalLength / depth;
+
+		pos = vec2((sx / aspect + 1) * width * 0.5f, (1 - sy) * height * 0.5f);
+		return true;
+	}
+};
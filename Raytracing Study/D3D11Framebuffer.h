@@ -0,0 +1,100 @@
+#pragma once
+#include <d3d11.h>
+#include "Framebuffer.h"
+
+// Dynamic texture mapped for the duration of a frame, so Render writes into memory the GPU reads.
+// The texture's format must match: RGBA8_SRGB for DXGI_FORMAT_R8G8B8A8_UNORM_SRGB, which the
+// sampler decodes back to the linear colors the raytracer produced.
+class D3D11Framebuffer : public Framebuffer
+{
+public:
+	D3D11Framebuffer(ID3D11DeviceContext* deviceContext, ID3D11Texture2D* texture, int width, int height, PixelFormat format)
+		: Framebuffer(width, height, format), deviceContext(deviceContext), texture(texture)
+	{
+	}
+
+	FramebufferView Lock()
+	{
+		D3D11_MAPPED_SUBRESOURCE ms;
+		if (FAILED(deviceContext->Map(texture, 0, D3D11_MAP_WRITE_DISCARD, 0, &ms))) return FramebufferView();
+
+		return FramebufferView(static_cast<uint8_t*>(ms.pData), ms.RowPitch, format, width, height);
+	}
+
+	void Unlock()
+	{
+		deviceContext->Unmap(texture, 0);
+	}
+
+	// WRITE_DISCARD hands out fresh memory on every Map.
+	bool Persistent() const
+	{
+		return false;
+	}
+
+	ID3D11Texture2D* Texture() const
+	{
+		return texture;
+	}
+
+protected:
+	ID3D11DeviceContext* deviceContext;
+	ID3D11Texture2D* texture;
+};
+
+// Staging texture filled on a render thread and copied to the displayed texture on the GPU. The
+// immediate context is not thread-safe, so the presenter maps it with Map before the render
+// thread gets it and unmaps it with Unmap before CopyResource; Lock and Unlock only pass that
+// mapping on. Takes ownership of the texture.
+class D3D11StagingFramebuffer : public D3D11Framebuffer
+{
+public:
+	D3D11StagingFramebuffer(ID3D11DeviceContext* deviceContext, ID3D11Texture2D* texture, int width, int height, PixelFormat format)
+		: D3D11Framebuffer(deviceContext, texture, width, height, format)
+	{
+	}
+
+	~D3D11StagingFramebuffer()
+	{
+		Unmap();
+		texture->Release();
+	}
+
+	// False, leaving it unmapped, while the GPU still reads the texture.
+	bool Map()
+	{
+		if (mapped.data) return true;
+
+		D3D11_MAPPED_SUBRESOURCE ms;
+		if (FAILED(deviceContext->Map(texture, 0, D3D11_MAP_WRITE, D3D11_MAP_FLAG_DO_NOT_WAIT, &ms))) return false;
+
+		mapped = FramebufferView(static_cast<uint8_t*>(ms.pData), ms.RowPitch, format, width, height);
+		return true;
+	}
+
+	void Unmap()
+	{
+		if (!mapped.data) return;
+
+		deviceContext->Unmap(texture, 0);
+		mapped = FramebufferView();
+	}
+
+	FramebufferView Lock()
+	{
+		return mapped;
+	}
+
+	void Unlock()
+	{
+	}
+
+	// Staging memory keeps what was written through earlier maps.
+	bool Persistent() const
+	{
+		return true;
+	}
+
+private:
+	FramebufferView mapped;
+};
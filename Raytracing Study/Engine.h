@@ -8,6 +8,9 @@
 #include <algorithm>
 #include <glm/glm.hpp>
 #include "Raytracer.h"
+#include "SceneLoader.h"
+#include "D3D11Framebuffer.h"
+#include "AsyncRenderer.h"
 
 struct Vertex
 {
@@ -20,7 +23,18 @@ class Engine
 public:
 	int width, height;
 	Raytracer raytracer;
-	std::vector<glm::vec4> pixels;
+
+	// Traces off the UI thread into a ring of staging textures; Update copies whichever frame it
+	// finished last into canvasTexture on the GPU. copied is the ring entry copied last, mapped
+	// again before the renderer may reuse it.
+	std::unique_ptr<AsyncRenderer> renderer;
+	std::vector<D3D11StagingFramebuffer*> staging;
+	int copied = -1;
+	uint64_t shownFrame = 0;
+
+	// Progressive jobs publish a refined frame every frameBudget seconds.
+	bool progressive = true;
+	double frameBudget = 0.012;
 
 	ID3D11Device* device;
 	ID3D11DeviceContext* deviceContext;
@@ -41,24 +55,81 @@ public:
 
 	Engine(HWND window, int width, int height) : raytracer(width, height)
 	{
+		SceneLoader().Load("default.scene", raytracer);
 		Initialize(window, width, height);
 	}
 
 	void Update()
 	{
-		static int count = 0;
-		if (count == 0) 
-		{ 
-			pixels.resize(raytracer.width * raytracer.height);
+		if (!canvasTexture) return;
 
-			raytracer.Render(pixels);
+		if (!renderer)
+		{
+			if (!CreateRing(3)) return;
+			Restart();
+		}
 
-			D3D11_MAPPED_SUBRESOURCE ms;
-			deviceContext->Map(canvasTexture, NULL, D3D11_MAP_WRITE_DISCARD, NULL, &ms);
-			memcpy(ms.pData, pixels.data(), pixels.size() * sizeof(glm::vec4));
-			deviceContext->Unmap(canvasTexture, NULL);
+		// the texture copied last time goes back to the renderer mapped; while the GPU still reads
+		// it, it stays held and the canvas stays as it is
+		if (copied >= 0)
+		{
+			if (!staging[copied]->Map()) return;
+			copied = -1;
 		}
-		count++;
+
+		uint64_t frame = 0;
+		Framebuffer* latest = renderer->Present(frame);
+		if (!latest || frame == shownFrame) return;
+
+		const int index = int(std::find(staging.begin(), staging.end(), latest) - staging.begin());
+		staging[index]->Unmap();
+		deviceContext->CopyResource(canvasTexture, staging[index]->Texture());
+		copied = index;
+		shownFrame = frame;
+	}
+
+	// Staging textures for the renderer, mapped for its first frames.
+	bool CreateRing(int count)
+	{
+		D3D11_TEXTURE2D_DESC textureDesc;
+		canvasTexture->GetDesc(&textureDesc);
+		textureDesc.Usage = D3D11_USAGE_STAGING;
+		textureDesc.BindFlags = 0;
+		textureDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+
+		std::vector<std::unique_ptr<Framebuffer>> ring;
+		staging.clear();
+		for (int i = 0; i < count; i++)
+		{
+			ID3D11Texture2D* texture = nullptr;
+			if (FAILED(device->CreateTexture2D(&textureDesc, nullptr, &texture)))
+			{
+				std::cout << "CreateTexture2D() error" << std::endl;
+				staging.clear();
+				return false;
+			}
+
+			auto buffer = std::make_unique<D3D11StagingFramebuffer>(deviceContext, texture, raytracer.width, raytracer.height, PixelFormat::RGBA8_SRGB);
+			buffer->Map();
+			staging.push_back(buffer.get());
+			ring.push_back(std::move(buffer));
+		}
+
+		renderer = std::make_unique<AsyncRenderer>(raytracer, std::move(ring));
+		return true;
+	}
+
+	// Abandons the frame in flight and starts over, after setup has changed the scene or camera
+	// on the render thread.
+	void Restart(std::function<void(Raytracer&)> setup = {})
+	{
+		renderer->Cancel();
+
+		AsyncRenderer::FrameJob job;
+		job.setup = setup;
+		job.progressive = progressive;
+		job.budget = frameBudget;
+		renderer->Submit(job);
 	}
 
 	void InitShaders()
@@ -177,12 +248,12 @@ public:
 		D3D11_TEXTURE2D_DESC textureDesc;
 		ZeroMemory(&textureDesc, sizeof(textureDesc));
 		textureDesc.MipLevels = textureDesc.ArraySize = 1;
-		textureDesc.Format = DXGI_FORMAT_R32G32B32A32_FLOAT;
+		textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
 		textureDesc.SampleDesc.Count = 1;
-		textureDesc.Usage = D3D11_USAGE_DYNAMIC;
+		textureDesc.Usage = D3D11_USAGE_DEFAULT;
 		textureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
 		textureDesc.MiscFlags = 0;
-		textureDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		textureDesc.CPUAccessFlags = 0;
 		textureDesc.Width = raytracer.width;
 		textureDesc.Height = raytracer.height;
 
@@ -299,6 +370,9 @@ public:
 
 	void Clean()
 	{
+		renderer.reset();
+		staging.clear();
+
 		if (layout)
 		{
 			layout->Release();
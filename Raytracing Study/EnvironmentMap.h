@@ -0,0 +1,66 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <glm/glm.hpp>
+#include "Texture.h"
+using namespace glm;
+
+// Radiance arriving from infinitely far away, looked up by direction on the six faces of a cube
+// (+x, -x, +y, -y, +z, -z). Each face image is seen from inside the cube, upright, with +y up;
+// the top and bottom faces have +x to the right.
+class EnvironmentMap
+{
+public:
+	enum Face { PosX, NegX, PosY, NegY, PosZ, NegZ };
+
+	std::shared_ptr<Texture> faces[6];
+
+	// Loads prefix + posx/negx/posy/negy/posz/negz + extension through Texture::Open.
+	void Load(const std::string& prefix = "", const std::string& extension = ".jpg")
+	{
+		static const char* names[6] = { "posx", "negx", "posy", "negy", "posz", "negz" };
+		for (int f = 0; f < 6; f++) faces[f] = Texture::Open(prefix + names[f] + extension);
+	}
+
+	bool IsEmpty() const
+	{
+		return !faces[0];
+	}
+
+	// spread is the angular width of the ray cone; 0 samples the full-resolution levels.
+	vec3 Sample(const vec3& dir, float spread) const
+	{
+		if (IsEmpty()) return vec3(0);
+
+		const vec3 a = glm::abs(dir);
+
+		Face face;
+		float major;
+		vec2 uv;
+
+		if (a.x >= a.y && a.x >= a.z)
+		{
+			major = a.x;
+			face = dir.x > 0 ? PosX : NegX;
+			uv = vec2(dir.x > 0 ? -dir.z : dir.z, -dir.y);
+		}
+		else if (a.y >= a.z)
+		{
+			major = a.y;
+			face = dir.y > 0 ? PosY : NegY;
+			uv = vec2(dir.x, dir.y > 0 ? dir.z : -dir.z);
+		}
+		else
+		{
+			major = a.z;
+			face = dir.z > 0 ? PosZ : NegZ;
+			uv = vec2(dir.z > 0 ? dir.x : -dir.x, -dir.y);
+		}
+
+		uv = (uv / major + vec2(1)) * 0.5f;
+
+		// the face spans two units at distance one; off-axis the cone lands farther and more obliquely
+		const float footprint = spread * 0.5f / (major * major);
+		return faces[face]->Sample(uv, footprint);
+	}
+};
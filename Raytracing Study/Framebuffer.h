@@ -0,0 +1,174 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <glm/glm.hpp>
+using namespace glm;
+
+enum class PixelFormat
+{
+	RGBA32F,
+	RGBA8,      // colors stored as they are, like the float format shown on an 8-bit display
+	RGBA8_SRGB, // colors taken as linear and encoded with the sRGB curve, for *_SRGB textures
+};
+
+inline int PixelSize(PixelFormat format)
+{
+	return format == PixelFormat::RGBA32F ? 16 : 4;
+}
+
+// Locked framebuffer memory: row y starts pitch * y bytes after data.
+class FramebufferView
+{
+public:
+	uint8_t* data = nullptr;
+	size_t pitch = 0;
+	PixelFormat format = PixelFormat::RGBA32F;
+	int width = 0, height = 0;
+
+	FramebufferView()
+	{
+	}
+
+	FramebufferView(uint8_t* data, size_t pitch, PixelFormat format, int width, int height)
+		: data(data), pitch(pitch), format(format), width(width), height(height)
+	{
+	}
+
+	void Store(int x, int y, const vec4& color) const
+	{
+		uint8_t* pixel = data + pitch * y + size_t(x) * PixelSize(format);
+
+		if (format == PixelFormat::RGBA32F)
+		{
+			memcpy(pixel, &color, sizeof(color));
+			return;
+		}
+
+		const vec4 c = glm::clamp(color, 0.0f, 1.0f);
+		if (format == PixelFormat::RGBA8_SRGB)
+		{
+			for (int k = 0; k < 3; k++) pixel[k] = srgbTable[int(c[k] * srgbSteps + 0.5f)];
+		}
+		else
+		{
+			for (int k = 0; k < 3; k++) pixel[k] = uint8_t(c[k] * 255.0f + 0.5f);
+		}
+		pixel[3] = uint8_t(c.a * 255.0f + 0.5f);
+	}
+
+	vec4 Load(int x, int y) const
+	{
+		const uint8_t* pixel = data + pitch * y + size_t(x) * PixelSize(format);
+
+		vec4 color;
+		if (format == PixelFormat::RGBA32F)
+		{
+			memcpy(&color, pixel, sizeof(color));
+			return color;
+		}
+
+		for (int k = 0; k < 4; k++) color[k] = pixel[k] / 255.0f;
+		if (format == PixelFormat::RGBA8_SRGB)
+		{
+			for (int k = 0; k < 3; k++) color[k] = color[k] <= 0.04045f ? color[k] / 12.92f : glm::pow((color[k] + 0.055f) / 1.055f, 2.4f);
+		}
+		return color;
+	}
+
+private:
+	// Linear values are quantized to 12 bits before encoding, finer than the curve's steepest 8-bit step.
+	static const int srgbSteps = 4095;
+
+	static inline const std::array<uint8_t, srgbSteps + 1> srgbTable = [] {
+		std::array<uint8_t, srgbSteps + 1> table;
+		for (int i = 0; i <= srgbSteps; i++)
+		{
+			const float linear = float(i) / srgbSteps;
+			const float encoded = linear <= 0.0031308f ? linear * 12.92f : 1.055f * glm::pow(linear, 1 / 2.4f) - 0.055f;
+			table[i] = uint8_t(encoded * 255.0f + 0.5f);
+		}
+		return table;
+	}();
+};
+
+// Copies whole rows when the formats match and converts pixel by pixel otherwise.
+inline void CopyPixels(const FramebufferView& from, const FramebufferView& to)
+{
+	const int width = glm::min(from.width, to.width);
+	const int height = glm::min(from.height, to.height);
+
+	for (int y = 0; y < height; y++)
+	{
+		if (from.format == to.format)
+		{
+			memcpy(to.data + to.pitch * y, from.data + from.pitch * y, size_t(width) * PixelSize(from.format));
+			continue;
+		}
+
+		for (int x = 0; x < width; x++) to.Store(x, y, from.Load(x, y));
+	}
+}
+
+// Destination Render writes through. Lock hands out memory the backend owns or has mapped, so
+// pixels land where they are consumed without an intermediate copy.
+class Framebuffer
+{
+public:
+	int width, height;
+	PixelFormat format;
+
+	Framebuffer(int width, int height, PixelFormat format) : width(width), height(height), format(format)
+	{
+	}
+
+	virtual ~Framebuffer()
+	{
+	}
+
+	// Returns a null view when the memory is unavailable.
+	virtual FramebufferView Lock() = 0;
+	virtual void Unlock()
+	{
+	}
+
+	// Whether pixels not written since the last Lock keep their values. If not, every frame
+	// must write every pixel.
+	virtual bool Persistent() const
+	{
+		return true;
+	}
+};
+
+// Headless framebuffer in system memory, rows packed without padding.
+class MemoryFramebuffer : public Framebuffer
+{
+public:
+	std::vector<uint8_t> bytes;
+
+	MemoryFramebuffer(int width, int height, PixelFormat format = PixelFormat::RGBA8)
+		: Framebuffer(width, height, format), bytes(size_t(width) * height * PixelSize(format))
+	{
+	}
+
+	FramebufferView Lock()
+	{
+		return View();
+	}
+
+	FramebufferView View()
+	{
+		return FramebufferView(bytes.data(), size_t(width) * PixelSize(format), format, width, height);
+	}
+
+	size_t Pitch() const
+	{
+		return size_t(width) * PixelSize(format);
+	}
+
+	vec4 Pixel(int x, int y)
+	{
+		return View().Load(x, y);
+	}
+};
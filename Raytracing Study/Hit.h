@@ -3,8 +3,6 @@
 #include <glm/glm.hpp>
 using namespace glm;
 
-class Object;
-
 class Hit
 {
 public:
@@ -13,5 +11,12 @@ public:
 	vec3 normal;
 	vec2 uv;
 
-	std::shared_ptr<Object> obj;
+	// uv units per world unit around point, 0 where the surface has no uvs
+	float uvScale = 0;
+	// 1 / radius of curvature, 0 for flat surfaces
+	float curvature = 0;
+
+	// index into Raytracer::prims and Raytracer::materials, filled in by the scene
+	int prim = -1;
+	int material = -1;
 };
\ No newline at end of file
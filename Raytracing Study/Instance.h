@@ -0,0 +1,87 @@
+#pragma once
+#include <memory>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "Object.h"
+using namespace glm;
+
+// Places shared geometry in the scene through an affine transform. A ray is taken into the
+// geometry's space and tested against the geometry itself, BVH and all, so the scene BVH over
+// instances is the top level and each mesh's or sphere set's own BVH the bottom one. A thousand
+// instances of one mesh hold one copy of its triangles.
+//
+// The instance shades with the geometry's material unless overrideMaterial is set, in which case
+// its own material applies. The geometry must not be in the scene itself.
+class Instance : public Object
+{
+public:
+	std::shared_ptr<Object> geometry;
+	bool overrideMaterial = false;
+
+	Instance(std::shared_ptr<Object> geometry, const mat4& transform = mat4(1)) : geometry(std::move(geometry))
+	{
+		SetTransform(transform);
+	}
+
+	const mat4& Transform() const
+	{
+		return toWorld;
+	}
+
+	void SetTransform(const mat4& transform)
+	{
+		toWorld = transform;
+		toObject = glm::inverse(transform);
+		normalToWorld = glm::transpose(mat3(toObject));
+	}
+
+	const Material& GetMaterial() const
+	{
+		return overrideMaterial ? material : geometry->GetMaterial();
+	}
+
+	Hit CheckRayCollision(Ray& ray)
+	{
+		// object units per world unit along the ray, to keep hit distances in world units
+		const vec3 dir = mat3(toObject) * ray.dir;
+		const float scale = glm::length(dir);
+
+		Ray local = ray;
+		local.start = vec3(toObject * vec4(ray.start, 1));
+		local.dir = dir / scale;
+		local.width = ray.width * scale;
+
+		Hit hit = geometry->CheckRayCollision(local);
+		if (hit.d < 0) return hit;
+
+		hit.d /= scale;
+		hit.point = ray.start + hit.d * ray.dir;
+		hit.normal = glm::normalize(normalToWorld * hit.normal);
+		hit.uvScale *= scale;
+		hit.curvature *= scale;
+		return hit;
+	}
+
+	AABB GetBounds()
+	{
+		const AABB local = geometry->GetBounds();
+		if (local.IsEmpty()) return local;
+
+		AABB bounds;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			const vec3 p((corner & 1) ? local.upper.x : local.lower.x, (corner & 2) ? local.upper.y : local.lower.y, (corner & 4) ? local.upper.z : local.lower.z);
+			bounds.Expand(vec3(toWorld * vec4(p, 1)));
+		}
+		return bounds;
+	}
+
+	void Translate(const vec3& offset)
+	{
+		SetTransform(glm::translate(mat4(1), offset) * toWorld);
+	}
+
+private:
+	mat4 toWorld, toObject;
+	mat3 normalToWorld;
+};
@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read-only view of a whole file. Pages are only read from disk when they are first touched.
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	bool Open(const std::string& filename)
+	{
+		Close();
+
+#ifdef _WIN32
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER fileSize;
+		HANDLE mapping = nullptr;
+		if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		{
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		}
+		CloseHandle(file);
+		if (!mapping) return false;
+
+		void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		if (!view) return false;
+
+		data = static_cast<const uint8_t*>(view);
+		size = size_t(fileSize.QuadPart);
+#else
+		const int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat info;
+		void* view = MAP_FAILED;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (view == MAP_FAILED) return false;
+
+		// lookups jump between tiles, read-ahead would only page in what is never sampled
+		madvise(view, size_t(info.st_size), MADV_RANDOM);
+
+		data = static_cast<const uint8_t*>(view);
+		size = size_t(info.st_size);
+#endif
+		return true;
+	}
+
+	void Close()
+	{
+		if (!data) return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap(const_cast<uint8_t*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const uint8_t* Data() const
+	{
+		return data;
+	}
+
+	size_t Size() const
+	{
+		return size;
+	}
+
+private:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+};
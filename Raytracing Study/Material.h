@@ -0,0 +1,23 @@
+#pragma once
+#include <memory>
+#include <glm/glm.hpp>
+#include "Texture.h"
+using namespace glm;
+
+class Material
+{
+public:
+	vec3 amb = vec3(0);
+	vec3 diff = vec3(0);
+	vec3 spec = vec3(0);
+	float alpha = 10;
+	float reflection = 0;
+	float transparency = 0;
+
+	std::shared_ptr<Texture> ambTexture;
+	std::shared_ptr<Texture> diffTexture;
+
+	Material(const vec3& color = { 1, 1, 1 }) : amb(color), diff(color), spec(color)
+	{
+	}
+};
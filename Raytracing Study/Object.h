@@ -2,26 +2,38 @@
 #include <iostream>
 #include <glm/glm.hpp>
 
+#include "AABB.h"
 #include "Hit.h"
 #include "Ray.h"
-#include "Texture.h"
+#include "Material.h"
+#include "TraceStats.h"
 
 class Object
 {
 public:
-	vec3 amb = vec3(0);
-	vec3 diff = vec3(0);
-	vec3 spec = vec3(0);
-	float alpha = 10;
-	float reflection = 0;
-	float transparency = 0;
+	Material material;
 
-	std::shared_ptr<Texture> ambTexture;
-	std::shared_ptr<Texture> diffTexture;
+	Object(const vec3& color = { 1, 1, 1 }) : material(color)
+	{
+	}
 
-	Object(const vec3& color = { 1, 1, 1 }) : amb(color), diff(color), spec(color)
+	// The material hits on this object shade with; instances may take their geometry's.
+	virtual const Material& GetMaterial() const
 	{
+		return material;
 	}
 
 	virtual Hit CheckRayCollision(Ray& ray) = 0;
+	virtual AABB GetBounds() = 0;
+
+	// Whether a ray leaving the surface can never meet the object again, so shadow rays may skip
+	// it. Aggregates such as meshes shadow themselves.
+	virtual bool Convex() const
+	{
+		return false;
+	}
+
+	// Moves the geometry. Objects in a Raytracer are moved through Raytracer::MoveObject so the
+	// scene's bounds follow.
+	virtual void Translate(const vec3& offset) = 0;
 };
\ No newline at end of file
@@ -0,0 +1,341 @@
+// Packet-vs-primitive kernels. RayPacket.h includes this once per SIMD width with PACKET_FLOAT
+// and PACKET_NAMESPACE defined. Each kernel mirrors the scalar test in Sphere.h / Triangle.h.
+
+namespace PACKET_NAMESPACE
+{
+	typedef PACKET_FLOAT F;
+
+	struct Rays
+	{
+		F ox, oy, oz;
+		F dx, dy, dz;
+		F ix, iy, iz;
+	};
+
+	inline Rays LoadRays(const RayPacket& packet)
+	{
+		Rays r;
+		r.ox = F::Load(packet.ox);
+		r.oy = F::Load(packet.oy);
+		r.oz = F::Load(packet.oz);
+		r.dx = F::Load(packet.dx);
+		r.dy = F::Load(packet.dy);
+		r.dz = F::Load(packet.dz);
+
+		const F one = F::Set(1.0f);
+		r.ix = one / r.dx;
+		r.iy = one / r.dy;
+		r.iz = one / r.dz;
+		return r;
+	}
+
+	inline int IntersectBox(const Rays& r, const F& tMax, const AABB& box, F& tNear)
+	{
+		const F t0x = (F::Set(box.lower.x) - r.ox) * r.ix;
+		const F t0y = (F::Set(box.lower.y) - r.oy) * r.iy;
+		const F t0z = (F::Set(box.lower.z) - r.oz) * r.iz;
+		const F t1x = (F::Set(box.upper.x) - r.ox) * r.ix;
+		const F t1y = (F::Set(box.upper.y) - r.oy) * r.iy;
+		const F t1z = (F::Set(box.upper.z) - r.oz) * r.iz;
+
+		tNear = F::Max(F::Max(F::Min(t0x, t1x), F::Min(t0y, t1y)), F::Max(F::Min(t0z, t1z), F::Set(0.0f)));
+		const F tFar = F::Min(F::Min(F::Max(t0x, t1x), F::Max(t0y, t1y)), F::Min(F::Max(t0z, t1z), tMax));
+
+		return (tNear <= tFar).Mask();
+	}
+
+	inline int IntersectSphere(const Rays& r, F& tMax, const vec3& center, float radius)
+	{
+		const F ocx = r.ox - F::Set(center.x);
+		const F ocy = r.oy - F::Set(center.y);
+		const F ocz = r.oz - F::Set(center.z);
+
+		const F b = r.dx * ocx + r.dy * ocy + r.dz * ocz;
+		const F c = ocx * ocx + ocy * ocy + ocz * ocz - F::Set(radius * radius);
+		const F det = b * b - c;
+
+		const F s = F::Sqrt(F::Max(det, F::Set(0.0f)));
+		const F d1 = -b + s;
+		const F d2 = -b - s;
+		const F dNear = F::Min(d1, d2);
+		const F t = F::Select(dNear < F::Set(0.0f), F::Max(d1, d2), dNear);
+
+		const F hit = (det >= F::Set(0.0f)) & (t >= F::Set(0.0f)) & (t < tMax);
+		tMax = F::Select(hit, t, tMax);
+		return hit.Mask();
+	}
+
+	inline int IntersectTriangle(const Rays& r, F& tMax, const TriangleRecord& tri)
+	{
+		const F e1x = F::Set(tri.e1.x), e1y = F::Set(tri.e1.y), e1z = F::Set(tri.e1.z);
+		const F e2x = F::Set(tri.e2.x), e2y = F::Set(tri.e2.y), e2z = F::Set(tri.e2.z);
+
+		const F px = r.dy * e2z - r.dz * e2y;
+		const F py = r.dz * e2x - r.dx * e2z;
+		const F pz = r.dx * e2y - r.dy * e2x;
+		const F det = e1x * px + e1y * py + e1z * pz;
+
+		F hit = det > F::Set(0.0f);
+		if (!hit.Mask()) return 0;
+
+		const F sx = r.ox - F::Set(tri.v0.x);
+		const F sy = r.oy - F::Set(tri.v0.y);
+		const F sz = r.oz - F::Set(tri.v0.z);
+		const F u = sx * px + sy * py + sz * pz;
+		hit = hit & (u >= F::Set(0.0f)) & (u <= det);
+		if (!hit.Mask()) return 0;
+
+		const F qx = sy * e1z - sz * e1y;
+		const F qy = sz * e1x - sx * e1z;
+		const F qz = sx * e1y - sy * e1x;
+		const F v = r.dx * qx + r.dy * qy + r.dz * qz;
+		hit = hit & (v >= F::Set(0.0f)) & (u + v <= det);
+		if (!hit.Mask()) return 0;
+
+		const F t = (e2x * qx + e2y * qy + e2z * qz) * (F::Set(1.0f) / det);
+		hit = hit & (t >= F::Set(0.0f)) & (t < tMax);
+
+		tMax = F::Select(hit, t, tMax);
+		return hit.Mask();
+	}
+
+	inline int IntersectObject(RayPacket& packet, F& tMax, Object* object)
+	{
+		tMax.Store(packet.tMax);
+
+		int hits = 0;
+		for (int k = 0; k < F::width; k++)
+		{
+			if (packet.tMax[k] < 0) continue;
+
+			Ray ray{ vec3(packet.ox[k], packet.oy[k], packet.oz[k]), vec3(packet.dx[k], packet.dy[k], packet.dz[k]) };
+			auto hit = object->CheckRayCollision(ray);
+
+			if (hit.d >= 0 && hit.d < packet.tMax[k]) {
+				packet.tMax[k] = hit.d;
+				hits |= 1 << k;
+			}
+		}
+
+		tMax = F::Load(packet.tMax);
+		return hits;
+	}
+
+	// One ray against count spheres stored as separate x/y/z/radius arrays, two registers per
+	// iteration. Returns the index of the nearest hit closer than tMax, or -1.
+	inline int IntersectSpheres(const Ray& ray, const float* cx, const float* cy, const float* cz, const float* radii, int count, float& tMax)
+	{
+		alignas(32) static const float laneIndex[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+		const F ox = F::Set(ray.start.x), oy = F::Set(ray.start.y), oz = F::Set(ray.start.z);
+		const F dx = F::Set(ray.dir.x), dy = F::Set(ray.dir.y), dz = F::Set(ray.dir.z);
+		const F lanes = F::Load(laneIndex);
+		const F end = F::Set(float(count));
+		const F zero = F::Set(0.0f);
+
+		F bestT[2] = { F::Set(tMax), F::Set(tMax) };
+		F bestIndex[2] = { F::Set(-1.0f), F::Set(-1.0f) };
+
+		for (int i = 0; i < count; i += 2 * F::width)
+		{
+			for (int u = 0; u < 2; u++)
+			{
+				const int base = i + u * F::width;
+
+				const F ocx = ox - F::LoadUnaligned(cx + base);
+				const F ocy = oy - F::LoadUnaligned(cy + base);
+				const F ocz = oz - F::LoadUnaligned(cz + base);
+				const F r = F::LoadUnaligned(radii + base);
+
+				const F b = dx * ocx + dy * ocy + dz * ocz;
+				const F c = ocx * ocx + ocy * ocy + ocz * ocz - r * r;
+				const F det = b * b - c;
+
+				const F s = F::Sqrt(F::Max(det, zero));
+				const F d1 = -b + s;
+				const F d2 = -b - s;
+				const F dNear = F::Min(d1, d2);
+				const F t = F::Select(dNear < zero, F::Max(d1, d2), dNear);
+
+				const F index = F::Set(float(base)) + lanes;
+				const F hit = (index < end) & (det >= zero) & (t >= zero) & (t < bestT[u]);
+
+				bestT[u] = F::Select(hit, t, bestT[u]);
+				bestIndex[u] = F::Select(hit, index, bestIndex[u]);
+			}
+		}
+
+		alignas(32) float t[2][F::width], index[2][F::width];
+		for (int u = 0; u < 2; u++)
+		{
+			bestT[u].Store(t[u]);
+			bestIndex[u].Store(index[u]);
+		}
+
+		int nearest = -1;
+		for (int u = 0; u < 2; u++)
+		{
+			for (int k = 0; k < F::width; k++)
+			{
+				if (index[u][k] < 0) continue;
+
+				const int i = int(index[u][k]);
+				if (t[u][k] < tMax || (t[u][k] == tMax && i < nearest))
+				{
+					tMax = t[u][k];
+					nearest = i;
+				}
+			}
+		}
+
+		return nearest;
+	}
+
+	inline float MinLane(const F& t, int mask)
+	{
+		alignas(32) float lanes[F::width];
+		t.Store(lanes);
+
+		float m = FLT_MAX;
+		for (; mask; mask &= mask - 1) m = glm::min(m, lanes[LowestBit(mask)]);
+		return m;
+	}
+
+	// Closest hit for every lane; lanes with a negative tMax take no part.
+	inline void Traverse(const BVH& bvh, const PacketScene& scene, RayPacket& packet)
+	{
+		if (bvh.IsEmpty()) return;
+
+		const Rays r = LoadRays(packet);
+		F tMax = F::Load(packet.tMax);
+
+		int stack[BVH::stackSize];
+		int top = 0;
+		stack[top++] = 0;
+
+		while (top > 0)
+		{
+			const BVH::Node& node = bvh.nodes[stack[--top]];
+
+			TRACE_STAT(threadStats.nodeVisits += F::width);
+
+			F tNear;
+			if (!IntersectBox(r, tMax, node.bounds, tNear)) continue;
+
+			if (node.count > 0)
+			{
+				for (int i = 0; i < node.count; i++)
+				{
+					const int object = bvh.indices[node.left + i];
+					const PacketPrim& prim = scene.prims[object];
+
+					int hits = 0;
+					if (prim.type == PacketPrim::Sphere)
+					{
+						TRACE_STAT(threadStats.intersectionTests += F::width);
+						hits = IntersectSphere(r, tMax, prim.center, prim.radius);
+					}
+					else if (prim.type == PacketPrim::Triangles)
+					{
+						TRACE_STAT(threadStats.intersectionTests += prim.count * F::width);
+						for (int t = prim.first; t < prim.first + prim.count; t++) hits |= IntersectTriangle(r, tMax, scene.triangles[t]);
+					}
+					else hits = IntersectObject(packet, tMax, prim.object);
+
+					for (; hits; hits &= hits - 1) packet.object[LowestBit(hits)] = object;
+				}
+				continue;
+			}
+
+			F t0, t1;
+			const int hit0 = IntersectBox(r, tMax, bvh.nodes[node.left].bounds, t0);
+			const int hit1 = IntersectBox(r, tMax, bvh.nodes[node.left + 1].bounds, t1);
+
+			if (hit0 && hit1)
+			{
+				if (MinLane(t0, hit0) <= MinLane(t1, hit1))
+				{
+					stack[top++] = node.left + 1;
+					stack[top++] = node.left;
+				}
+				else
+				{
+					stack[top++] = node.left;
+					stack[top++] = node.left + 1;
+				}
+			}
+			else if (hit0) stack[top++] = node.left;
+			else if (hit1) stack[top++] = node.left + 1;
+		}
+
+		tMax.Store(packet.tMax);
+	}
+
+	// Any-hit query for every lane up to its tMax, which is not shortened by hits. blocks(object,
+	// hits) gets the lanes object is hit in and returns those that are done; they take no further
+	// part, and the traversal ends once every lane is.
+	template<typename Blocks>
+	inline void TraverseAny(const BVH& bvh, const PacketScene& scene, RayPacket& packet, Blocks blocks)
+	{
+		if (bvh.IsEmpty()) return;
+
+		const Rays r = LoadRays(packet);
+		F tMax = F::Load(packet.tMax);
+		int active = (tMax >= F::Set(0.0f)).Mask();
+
+		int stack[BVH::stackSize];
+		int top = 0;
+		stack[top++] = 0;
+
+		while (top > 0 && active)
+		{
+			const BVH::Node& node = bvh.nodes[stack[--top]];
+
+			TRACE_STAT(threadStats.nodeVisits += F::width);
+
+			F tNear;
+			if (!IntersectBox(r, tMax, node.bounds, tNear)) continue;
+
+			if (node.count == 0)
+			{
+				stack[top++] = node.left + 1;
+				stack[top++] = node.left;
+				continue;
+			}
+
+			for (int i = 0; i < node.count && active; i++)
+			{
+				const int object = bvh.indices[node.left + i];
+				const PacketPrim& prim = scene.prims[object];
+
+				F t = tMax;
+				int hits = 0;
+				if (prim.type == PacketPrim::Sphere)
+				{
+					TRACE_STAT(threadStats.intersectionTests += F::width);
+					hits = IntersectSphere(r, t, prim.center, prim.radius);
+				}
+				else if (prim.type == PacketPrim::Triangles)
+				{
+					TRACE_STAT(threadStats.intersectionTests += prim.count * F::width);
+					for (int k = prim.first; k < prim.first + prim.count; k++)
+					{
+						t = tMax;
+						hits |= IntersectTriangle(r, t, scene.triangles[k]);
+					}
+				}
+				else hits = IntersectObject(packet, t, prim.object);
+
+				const int done = hits ? blocks(object, hits & active) & active : 0;
+				if (!done) continue;
+
+				// retired lanes get a negative tMax, which every kernel rejects
+				active &= ~done;
+				alignas(32) float lanes[F::width];
+				tMax.Store(lanes);
+				for (int k = done; k; k &= k - 1) lanes[LowestBit(k)] = -1.0f;
+				tMax = F::Load(lanes);
+			}
+		}
+	}
+}
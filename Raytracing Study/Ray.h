@@ -7,4 +7,9 @@ class Ray
 public:
 	glm::vec3 start;
 	glm::vec3 dir;
+
+	// Isotropic ray differential: the ray stands for a cone that is width wide at start and
+	// widens by spread per unit of distance. Texture lookups use it to pick a mip level.
+	float width = 0;
+	float spread = 0;
 };
\ No newline at end of file
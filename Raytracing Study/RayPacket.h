@@ -0,0 +1,158 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cfloat>
+#include <glm/glm.hpp>
+#include "Simd.h"
+#include "BVH.h"
+#include "Sphere.h"
+#include "Triangle.h"
+#include "Square.h"
+using namespace glm;
+
+inline int LowestBit(int mask)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return int(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+class RayPacket
+{
+public:
+	static const int maxWidth = 8;
+
+	alignas(32) float ox[maxWidth], oy[maxWidth], oz[maxWidth];
+	alignas(32) float dx[maxWidth], dy[maxWidth], dz[maxWidth];
+	alignas(32) float tMax[maxWidth];
+	int object[maxWidth];
+
+	// Unused lanes repeat the first ray with a negative tMax so every kernel rejects them.
+	void Set(const Ray* rays, int count, int width, float tFar)
+	{
+		for (int k = 0; k < width; k++)
+		{
+			const Ray& ray = rays[k < count ? k : 0];
+
+			ox[k] = ray.start.x;
+			oy[k] = ray.start.y;
+			oz[k] = ray.start.z;
+			dx[k] = ray.dir.x;
+			dy[k] = ray.dir.y;
+			dz[k] = ray.dir.z;
+			tMax[k] = k < count ? tFar : -1.0f;
+			object[k] = -1;
+		}
+	}
+};
+
+class PacketPrim
+{
+public:
+	enum Type
+	{
+		Other,
+		Sphere,
+		Triangles,
+	};
+
+	Type type = Other;
+	Object* object = nullptr;
+
+	vec3 center = vec3(0);
+	float radius = 0;
+
+	int first = 0;
+	int count = 0;
+};
+
+// Flat copy of the scene geometry the packet kernels understand, indexed like Raytracer::objects.
+// Anything else is still tested ray by ray through Object::CheckRayCollision.
+class PacketScene
+{
+public:
+	std::vector<PacketPrim> prims;
+	std::vector<TriangleRecord> triangles;
+
+	void Build(const std::vector<std::shared_ptr<Object>>& objects)
+	{
+		prims.assign(objects.size(), PacketPrim());
+		triangles.clear();
+
+		for (size_t i = 0; i < objects.size(); i++)
+		{
+			PacketPrim& prim = prims[i];
+			prim.object = objects[i].get();
+
+			if (auto sphere = dynamic_cast<::Sphere*>(prim.object))
+			{
+				prim.type = PacketPrim::Sphere;
+				prim.center = sphere->center;
+				prim.radius = sphere->radius;
+			}
+			else if (auto square = dynamic_cast<Square*>(prim.object))
+			{
+				prim.type = PacketPrim::Triangles;
+				prim.first = int(triangles.size());
+				prim.count = 2;
+				AddTriangle(square->t1);
+				AddTriangle(square->t2);
+			}
+			else if (auto triangle = dynamic_cast<Triangle*>(prim.object))
+			{
+				prim.type = PacketPrim::Triangles;
+				prim.first = int(triangles.size());
+				prim.count = 1;
+				AddTriangle(*triangle);
+			}
+		}
+	}
+
+	void AddTriangle(const Triangle& triangle)
+	{
+		triangles.push_back(triangle.record);
+	}
+
+	void Trace(SimdLevel level, const BVH& bvh, RayPacket& packet) const;
+
+	// Any-hit counterpart of Trace; see PACKET_NAMESPACE::TraverseAny for blocks.
+	template<typename Blocks>
+	void TraceAny(SimdLevel level, const BVH& bvh, RayPacket& packet, Blocks blocks) const;
+};
+
+#if RAYTRACER_SIMD
+#define PACKET_FLOAT Float4
+#define PACKET_NAMESPACE PacketSSE
+#include "PacketKernels.inl"
+#undef PACKET_FLOAT
+#undef PACKET_NAMESPACE
+
+SIMD_BEGIN_AVX2
+#define PACKET_FLOAT Float8
+#define PACKET_NAMESPACE PacketAVX2
+#include "PacketKernels.inl"
+#undef PACKET_FLOAT
+#undef PACKET_NAMESPACE
+SIMD_END_AVX2
+#endif
+
+inline void PacketScene::Trace(SimdLevel level, const BVH& bvh, RayPacket& packet) const
+{
+#if RAYTRACER_SIMD
+	if (level == SimdLevel::AVX2) PacketAVX2::Traverse(bvh, *this, packet);
+	else PacketSSE::Traverse(bvh, *this, packet);
+#endif
+}
+
+template<typename Blocks>
+inline void PacketScene::TraceAny(SimdLevel level, const BVH& bvh, RayPacket& packet, Blocks blocks) const
+{
+#if RAYTRACER_SIMD
+	if (level == SimdLevel::AVX2) PacketAVX2::TraverseAny(bvh, *this, packet, blocks);
+	else PacketSSE::TraverseAny(bvh, *this, packet, blocks);
+#endif
+}
\ No newline at end of file
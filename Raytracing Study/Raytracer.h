@@ -4,7 +4,24 @@
 #include "Light.h"
 #include "Triangle.h"
 #include "Square.h" 
+#include "SphereSet.h"
+#include "TriangleMesh.h"
+#include "Instance.h"
+#include "EnvironmentMap.h"
+#include "Camera.h"
+#include "BVH.h"
+#include "RayPacket.h"
+#include "TileScheduler.h"
+#include "TraceStats.h"
+#include "Framebuffer.h"
 #include <vector> 
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 using namespace glm;
 using namespace std;
 
@@ -12,52 +29,307 @@ class Raytracer
 {
 public:
 	int width, height;
-	Light light;
+	Light light{};
 	vector<shared_ptr<Object>> objects;
 
+	// By default the eye is at z = -1.5 and the screen is the z = 0 plane.
+	Camera camera;
+
+	// What rays that hit nothing see.
+	EnvironmentMap environment;
+
+	// Flat copies of objects taken by BuildScene; Hit::prim and Hit::material index these so
+	// tracing never touches a reference count.
+	vector<Object*> prims;
+	vector<Material> materials;
+
+	BVH bvh;
+	bool useBVH = true;
+
+	// How UpdateScene brings bvh up to date when objects only moved. Adding or removing objects
+	// always rebuilds, since it renumbers the prims.
+	enum class UpdatePolicy
+	{
+		Auto,    // refit, and rebuild once the refitted tree costs rebuildRatio times its built cost
+		Refit,
+		Rebuild,
+	};
+	UpdatePolicy updatePolicy = UpdatePolicy::Auto;
+	float rebuildRatio = 1.3f;
+
+	// Edits applied by one UpdateScene and what applying them took.
+	struct SceneUpdate
+	{
+		int moved = 0;
+		int added = 0;
+		int removed = 0;
+		bool rebuilt = false;
+		float costRatio = 1; // SAH cost of the refitted bvh over its cost when built, 1 without a refit
+		double seconds = 0;
+	};
+	SceneUpdate pendingUpdate, lastUpdate;
+	float builtCost = 0;
+
+	// Counts BuildScene and UpdateScene calls that changed the scene.
+	uint64_t sceneVersion = 0;
+
+	PacketScene packetScene;
+	SimdLevel simdLevel = DetectSimd();
+	bool usePackets = true;
+
+	int maxDepth = 5;
+	int samplesPerPixel = 1;
+
+	// Adaptive anti-aliasing, used by the recursive Render when samplesPerPixel is 1 and
+	// adaptiveSamples is more. After one sample per pixel, a pixel is refined when a neighbour hit
+	// another prim, has a normal further than adaptiveNormalCos from its own, or differs by more than
+	// adaptiveContrast in some channel. It gets four stratified samples, and adaptiveSamples if those
+	// still spread by more than adaptiveSpread.
+	int adaptiveSamples = 0;
+	float adaptiveContrast = 0.1f;
+	float adaptiveSpread = 0.05f;
+	float adaptiveNormalCos = 0.95f;
+
+	// What the center sample of each pixel saw; prim is -1 for background.
+	struct PrimarySample
+	{
+		vec3 color;
+		vec3 normal;
+		int prim = -1;
+	};
+	vector<PrimarySample> primarySamples;
+
+	// Pixels the last adaptive Render refined and the primary rays they took beyond the first,
+	// by the first test that flagged them.
+	enum EdgeReason { PrimEdge, NormalEdge, ContrastEdge, EdgeReasonCount };
+	struct AdaptiveReport
+	{
+		int pixels[EdgeReasonCount] = {};
+		uint64_t extraRays[EdgeReasonCount] = {};
+		int fullySampled = 0; // pixels whose first four samples spread enough to go on to adaptiveSamples
+
+		AdaptiveReport& operator+=(const AdaptiveReport& other)
+		{
+			for (int k = 0; k < EdgeReasonCount; k++) {
+				pixels[k] += other.pixels[k];
+				extraRays[k] += other.extraRays[k];
+			}
+			fullySampled += other.fullySampled;
+			return *this;
+		}
+	};
+	AdaptiveReport lastAdaptive;
+
+	// Reflection and refraction branches whose path throughput falls below pruneThreshold are cut,
+	// or with russianRoulette survive with probability throughput / pruneThreshold. 0 traces everything.
+	float pruneThreshold = 0;
+	bool russianRoulette = false;
+
+	// Pick texture mip levels from the ray cones; off samples the full-resolution level only.
+	bool mipmapping = true;
+
+	int tileSize = 16;
+	int threadCount = 0;
+	unique_ptr<TileScheduler> scheduler;
+
+	// One entry of a wavefront queue: a ray, the weight its radiance carries into its sample slot,
+	// and the weighted direct light found where it lands.
+	struct WavefrontRay
+	{
+		Ray ray;
+		float weight;
+		int slot;
+		vec3 radiance;
+	};
+
+	bool wavefront = false;
+	int wavefrontChunk = 1024;
+	vector<size_t> lastQueueSizes;
+
+	// Running sums of RenderProgressive and the samples in each, for the camera and scene version
+	// they were traced with. progressiveTarget is the sample count the current pass brings every
+	// pixel up to.
+	vector<vec3> accumulation;
+	vector<int> sampleCounts;
+	Camera progressiveCamera;
+	uint64_t progressiveScene = 0;
+	int progressiveTarget = 1;
+	int maxProgressiveSamples = 256;
+
+	// What RenderReprojected keeps of each pixel. point is where color was shaded, at its depth
+	// along the ray that shaded it, and eye is where that ray came from; prim is -1 for background.
+	struct CachedPixel
+	{
+		vec3 color;
+		vec3 point;
+		vec3 eye;
+		int prim = -1;
+	};
+
+	vector<CachedPixel> reprojection, reprojected;
+	uint64_t reprojectionScene = 0;
+
+	// The previous frame scattered into the current one: per pixel, the nearest cached point that
+	// projects onto it, as its distance bits above its index in reprojection, or noSource.
+	static constexpr uint64_t noSource = ~uint64_t(0);
+	unique_ptr<std::atomic<uint64_t>[]> scattered;
+	size_t scatteredSize = 0;
+
+	// A cached color is reused while it was shaded within reprojectionTolerance pixel footprints of
+	// the new hit and, on specular surfaces, seen from no more than reprojectionMaxAngle radians
+	// away. Surfaces that reflect and transmit more than reprojectionMaxReflection of their light
+	// are shaded again whenever the eye moves.
+	float reprojectionTolerance = 1.0f;
+	float reprojectionMaxAngle = 0.02f;
+	float reprojectionMaxReflection = 0.1f;
+
+	// Fraction of the pixels showing geometry that the last RenderReprojected shaded again.
+	// Background pixels are traced every frame and do not count.
+	float lastRetraceRatio = 1;
+
+	TraceStats lastStats;
+
+	// Set from another thread to abandon the frame in flight: Render and RenderProgressive return
+	// once the tiles already started are done, leaving the rest of the target unwritten.
+	std::atomic<bool> cancelRequested{ false };
+
+	// Per-pixel cost written by Render (not by the wavefront or progressive paths) unless
+	// costMetric is None, e.g. for heatmaps. Packets share their cost evenly between their pixels.
+	// IntersectionTests and PrimaryRays count nothing when built with RAYTRACER_STATS=0.
+	enum class CostMetric
+	{
+		None,
+		IntersectionTests,
+		Nanoseconds,
+		PrimaryRays, // samples traced, which only varies with adaptive anti-aliasing
+	};
+	CostMetric costMetric = CostMetric::None;
+	vector<float> costBuffer;
+
+	// Blocker that ended the previous shadow query on this thread; neighbouring points are
+	// usually shadowed by the same prim, so it is tried before the BVH.
+	static inline thread_local int lastOccluder = -1;
+
+	// Ambient fraction left in full shadow.
+	static constexpr float minShadow = 0.3f;
+
+	// Starts with an empty scene. SceneLoader fills it in; default.scene is the one the viewer and
+	// the batch renderer load unless given another.
 	Raytracer(int& width, int& height) : width(width), height(height)
 	{
-		auto sphere1 = make_shared<Sphere>(vec3(0.3f, -0.5f, 2.25f), 1.0f);
+		BuildScene();
+	}
+
+	// Must be called after objects or their materials change. Pass buildBVH = false when bvh
+	// already holds a hierarchy over the current objects, e.g. one read back from a scene cache.
+	void BuildScene(bool buildBVH = true)
+	{
+		prims.resize(objects.size());
+		materials.resize(objects.size());
+		for (size_t i = 0; i < objects.size(); i++)
+		{
+			prims[i] = objects[i].get();
+			materials[i] = objects[i]->GetMaterial();
+		}
+
+		if (buildBVH) bvh.Build(PrimBounds(), objects.size() > BVH::parallelThreshold ? &Scheduler() : nullptr);
+		builtCost = bvh.Cost();
+
+		packetScene.Build(objects);
+		pendingUpdate = SceneUpdate();
+		sceneVersion++;
+	}
+
+	vector<AABB> PrimBounds() const
+	{
+		vector<AABB> bounds(prims.size());
+		for (size_t i = 0; i < prims.size(); i++) bounds[i] = prims[i]->GetBounds();
+		return bounds;
+	}
+
+	// Scene edits between frames. They take effect at the next UpdateScene, which Render runs
+	// itself when edits are pending.
+	void AddObject(const shared_ptr<Object>& object)
+	{
+		objects.push_back(object);
+		pendingUpdate.added++;
+	}
+
+	bool RemoveObject(const shared_ptr<Object>& object)
+	{
+		auto found = std::find(objects.begin(), objects.end(), object);
+		if (found == objects.end()) return false;
+
+		objects.erase(found);
+		pendingUpdate.removed++;
+		return true;
+	}
+
+	void MoveObject(size_t index, const vec3& offset)
+	{
+		objects[index]->Translate(offset);
+		pendingUpdate.moved++;
+	}
 
-		sphere1->amb = vec3(1.0f, 0.0f, 0.0f);
-		sphere1->diff = vec3(0.0f);
-		sphere1->spec = vec3(0.0f);
-		sphere1->alpha = 50.0f;
-		sphere1->reflection = 0.5f;
-		sphere1->transparency = 0.1f;
+	bool UpdatePending() const
+	{
+		return pendingUpdate.moved + pendingUpdate.added + pendingUpdate.removed > 0;
+	}
 
-		objects.push_back(sphere1); 
+	// Refits or rebuilds bvh after the edits since the last update, following updatePolicy, and
+	// records what it did in lastUpdate.
+	void UpdateScene()
+	{
+		if (!UpdatePending()) return;
 
-		auto sphere2 = make_shared<Sphere>(vec3(-1.75f, -0.6f, 2.0f), 0.9f);
+		const auto start = std::chrono::steady_clock::now();
+		SceneUpdate update = pendingUpdate;
 
-		sphere2->amb = vec3(0.2f);
-		sphere2->diff = vec3(0.0f);
-		sphere2->spec = vec3(0.0f);
-		sphere2->alpha = 50.0f;
-		sphere2->reflection = 0.0f;
-		sphere2->transparency = 0.9f;
+		if (update.added > 0 || update.removed > 0 || updatePolicy == UpdatePolicy::Rebuild)
+		{
+			BuildScene();
+			update.rebuilt = true;
+		}
+		else
+		{
+			// the packet tables hold copies of the moved geometry
+			packetScene.Build(objects);
 
-		objects.push_back(sphere2);
+			const vector<AABB> bounds = PrimBounds();
+			bvh.Refit(bounds);
+			update.costRatio = builtCost > 0 ? bvh.Cost() / builtCost : 1.0f;
 
+			if (updatePolicy == UpdatePolicy::Auto && update.costRatio > rebuildRatio)
+			{
+				bvh.Build(bounds, prims.size() > BVH::parallelThreshold ? &Scheduler() : nullptr);
+				builtCost = bvh.Cost();
+				update.rebuilt = true;
+			}
+		}
 
-		CubeMap();
+		update.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-		light = Light{ {0.4f, 6.5f, 9.5f} };
+		lastUpdate = update;
+		pendingUpdate = SceneUpdate();
+		sceneVersion++;
 	}
 
 	Hit FindClosestCollision(Ray& ray)
 	{
+		if (useBVH) return FindClosestCollisionBVH(ray);
+
 		float d = 1000;
 		Hit closestHit = Hit{ -1, dvec3(0), dvec3(0) };
 
-		for (auto obj : objects)
+		for (size_t i = 0; i < prims.size(); i++)
 		{
-			auto hit = obj->CheckRayCollision(ray);
+			auto hit = prims[i]->CheckRayCollision(ray);
 
 			if (hit.d >= 0 && hit.d < d) {
 				d = hit.d;
 				closestHit = hit;
-				closestHit.obj = obj;
+				closestHit.prim = int(i);
+				closestHit.material = int(i);
 
 				closestHit.uv = hit.uv;
 			}
@@ -66,7 +338,131 @@ public:
 		return closestHit;
 	}
 
-	vec3 traceRay(Ray& ray, int recursiveLevel)
+	Hit FindClosestCollisionBVH(Ray& ray)
+	{
+		float d = 1000;
+		Hit closestHit = Hit{ -1, dvec3(0), dvec3(0) };
+
+		bvh.Traverse(ray, d, [&](int i, float& tMax) {
+			auto hit = prims[i]->CheckRayCollision(ray);
+
+			if (hit.d >= 0 && hit.d < tMax) {
+				tMax = hit.d;
+				closestHit = hit;
+				closestHit.prim = i;
+				closestHit.material = i;
+			}
+		});
+
+		return closestHit;
+	}
+
+	int PacketWidth() const
+	{
+		return usePackets && useBVH ? int(simdLevel) : 1;
+	}
+
+	// Packets only pay off while every ray crosses the BVH in the same order, so rays whose
+	// direction signs disagree are traced one by one.
+	bool IsCoherent(const Ray* rays, int count)
+	{
+		for (int k = 1; k < count; k++) {
+			if ((rays[k].dir.x < 0) != (rays[0].dir.x < 0)) return false;
+			if ((rays[k].dir.y < 0) != (rays[0].dir.y < 0)) return false;
+			if ((rays[k].dir.z < 0) != (rays[0].dir.z < 0)) return false;
+		}
+		return true;
+	}
+
+	void FindClosestCollisionPacket(Ray* rays, int count, Hit* hits)
+	{
+		if (count < 2 || !IsCoherent(rays, count))
+		{
+			for (int k = 0; k < count; k++) hits[k] = FindClosestCollision(rays[k]);
+			return;
+		}
+
+		RayPacket packet;
+		packet.Set(rays, count, PacketWidth(), 1000);
+		packetScene.Trace(simdLevel, bvh, packet);
+
+		for (int k = 0; k < count; k++)
+		{
+			const int i = packet.object[k];
+			if (i < 0) {
+				hits[k] = Hit{ -1, dvec3(0), dvec3(0) };
+				continue;
+			}
+
+			hits[k] = prims[i]->CheckRayCollision(rays[k]);
+			hits[k].prim = i;
+			hits[k].material = i;
+		}
+	}
+
+	// Primary and shadow visibility are resolved per packet; shading and secondary rays stay per ray.
+	void TracePrimaryPacket(Ray* rays, int count, vec3* colors, Hit* hits)
+	{
+		TRACE_STAT(threadStats.primaryRays += count);
+		FindClosestCollisionPacket(rays, count, hits);
+
+		Hit lit[RayPacket::maxWidth];
+		int lanes[RayPacket::maxWidth];
+		int litCount = 0;
+		for (int k = 0; k < count; k++)
+		{
+			if (hits[k].d < 0) colors[k] = Background(rays[k]);
+			else
+			{
+				lit[litCount] = hits[k];
+				lanes[litCount++] = k;
+			}
+		}
+
+		bool occluded[RayPacket::maxWidth];
+		float shadow[RayPacket::maxWidth];
+		LightOccludedPacket(lit, litCount, occluded, shadow);
+
+		for (int s = 0; s < litCount; s++)
+		{
+			const int k = lanes[s];
+			colors[k] = Shade(rays[k], hits[k], occluded[s], shadow[s], maxDepth);
+		}
+	}
+
+	void RenderTilePackets(const TileScheduler::Tile& tile, const FramebufferView& target)
+	{
+		const int packetWidth = PacketWidth();
+
+		Ray rays[RayPacket::maxWidth];
+		vec3 colors[RayPacket::maxWidth];
+		Hit hits[RayPacket::maxWidth];
+		const bool adaptive = Adaptive();
+
+		for (int i = tile.y0; i < tile.y1; i++) {
+			for (int j = tile.x0; j < tile.x1; j += packetWidth) {
+				const int count = glm::min(packetWidth, tile.x1 - j);
+
+				for (int k = 0; k < count; k++) rays[k] = PrimaryRay(vec2(j + k, i));
+
+				const uint64_t cost = costMetric != CostMetric::None ? CostCounter() : 0;
+				TracePrimaryPacket(rays, count, colors, hits);
+
+				if (costMetric != CostMetric::None) {
+					const float share = float(CostCounter() - cost) / count;
+					for (int k = 0; k < count; k++) costBuffer[j + k + i * width] = share;
+				}
+
+				for (int k = 0; k < count; k++) {
+					const vec3 color = glm::clamp(colors[k], 0.0f, 1.0f);
+					target.Store(j + k, i, vec4(color, 1));
+					if (adaptive) primarySamples[j + k + i * width] = PrimarySample{ color, hits[k].normal, hits[k].d >= 0 ? hits[k].prim : -1 };
+				}
+			}
+		}
+	}
+
+	vec3 traceRay(Ray& ray, int recursiveLevel, float throughput = 1.0f)
 	{
 		if (recursiveLevel < 0) return vec3(0);
 
@@ -74,187 +470,1007 @@ public:
 
 		if (hit.d >= 0)
 		{
-			vec3 color(0);
-			vec3 phongColor(0);
+			float shadow;
+			const bool occluded = LightOccluded(hit, shadow);
+
+			return Shade(ray, hit, occluded, shadow, recursiveLevel, throughput);
+		}
+
+		return Background(ray);
+	}
+
+	vec3 Background(const Ray& ray)
+	{
+		return environment.Sample(ray.dir, mipmapping ? ray.spread : 0.0f);
+	}
+
+	// Any-hit query: whether a prim other than self blocks ray before maxDistance.
+	bool Occluded(Ray& ray, float maxDistance, int self = -1)
+	{
+		float shadow;
+		return FindOccluder(ray, maxDistance, self, FLT_MAX, shadow);
+	}
+
+	// Whether anything lies between hit.point and the light. When it does, shadow is the darkest
+	// max(transparency, minShadow) among the blockers.
+	bool LightOccluded(const Hit& hit, float& shadow)
+	{
+		Ray shadowRay = MakeShadowRay(hit);
+		TRACE_STAT(threadStats.shadowRays++);
+
+		return FindOccluder(shadowRay, glm::length(light.pos - hit.point), ShadowSelf(hit), minShadow, shadow);
+	}
+
+	// LightOccluded for count hits at once.
+	void LightOccludedPacket(const Hit* hits, int count, bool* occluded, float* shadow)
+	{
+		Ray shadowRays[RayPacket::maxWidth];
+		float distances[RayPacket::maxWidth];
+		int selves[RayPacket::maxWidth];
+		for (int k = 0; k < count; k++)
+		{
+			shadowRays[k] = MakeShadowRay(hits[k]);
+			distances[k] = glm::length(light.pos - hits[k].point);
+			selves[k] = ShadowSelf(hits[k]);
+		}
+		TRACE_STAT(threadStats.shadowRays += count);
+
+		FindOccluderPacket(shadowRays, count, distances, selves, minShadow, occluded, shadow);
+	}
+
+	// FindOccluder for up to PacketWidth() rays, each with its own distance and prim to skip.
+	// Lanes try the cached occluder first and leave the packet at their first stopping blocker.
+	void FindOccluderPacket(Ray* rays, int count, const float* maxDistances, const int* selves, float stopAt, bool* occluded, float* shadow)
+	{
+		if (count < 2 || !useBVH || !IsCoherent(rays, count))
+		{
+			for (int k = 0; k < count; k++) occluded[k] = FindOccluder(rays[k], maxDistances[k], selves[k], stopAt, shadow[k]);
+			return;
+		}
+
+		TRACE_STAT(threadStats.shadowQueries += count);
+
+		int blockers[RayPacket::maxWidth];
 
-			vec3 DirToLight = glm::normalize(light.pos - hit.point);
+		// prim i is hit by lane k before its maxDistance; true once the lane can stop
+		auto block = [&](int k, int i) {
+			occluded[k] = true;
+			shadow[k] = glm::min(shadow[k], glm::max(materials[i].transparency, minShadow));
+			if (shadow[k] > stopAt) return false;
 
-			Ray ShadowRay{ hit.point + DirToLight * 1e-4f, DirToLight };
-			Hit ShadowHit = FindClosestCollision(ShadowRay);
-			if (ShadowHit.d < 0 || ShadowHit.d > glm::length(light.pos - hit.point) || hit.obj == ShadowHit.obj) {
-				float diff = glm::max(dot(hit.normal, DirToLight), 0.0f);
+			blockers[k] = i;
+			return true;
+		};
+
+		RayPacket packet;
+		packet.Set(rays, count, PacketWidth(), 0);
+
+		const int cached = lastOccluder;
+		int fromCache = 0;
+		for (int k = 0; k < count; k++)
+		{
+			occluded[k] = false;
+			shadow[k] = 1;
+			blockers[k] = -1;
+			packet.tMax[k] = maxDistances[k];
 
-				vec3 ReflectDir = 2 * glm::dot(DirToLight, hit.normal) * hit.normal - DirToLight;
-				float spec = glm::pow(glm::max(glm::dot(DirToLight, -ray.dir), 0.0f), hit.obj->alpha);
+			if (cached < 0 || cached >= int(prims.size()) || cached == selves[k]) continue;
 
-				if (hit.obj->ambTexture) phongColor += hit.obj->amb * hit.obj->ambTexture->SampleLinear(hit.uv);
-				else phongColor += hit.obj->amb;
+			const Hit hit = prims[cached]->CheckRayCollision(rays[k]);
+			if (hit.d < 0 || hit.d > maxDistances[k] || !block(k, cached)) continue;
 
-				if (hit.obj->diffTexture) phongColor += hit.obj->diff * hit.obj->diffTexture->SampleLinear(hit.uv);
-				else phongColor += diff * hit.obj->diff;
+			// done before the traversal
+			packet.tMax[k] = -1;
+			fromCache |= 1 << k;
+			TRACE_STAT(threadStats.shadowCacheHits++);
+			TRACE_STAT(threadStats.shadowEarlyExits++);
+		}
 
-				phongColor += hit.obj->spec * spec;
+		packetScene.TraceAny(simdLevel, bvh, packet, [&](int object, int hits) {
+			int done = 0;
+			for (; hits; hits &= hits - 1)
+			{
+				const int k = LowestBit(hits);
+				if (object != selves[k] && block(k, object)) done |= 1 << k;
 			}
-			else {
-				if (hit.obj->ambTexture) phongColor = glm::max(ShadowHit.obj->transparency, 0.3f) * hit.obj->amb * hit.obj->ambTexture->SampleLinear(hit.uv);
-				else phongColor = glm::max(ShadowHit.obj->transparency, 0.3f) * hit.obj->amb;
+			return done;
+		});
+
+		for (int k = 0; k < count; k++)
+		{
+			if (blockers[k] < 0 || (fromCache & (1 << k))) continue;
+
+			lastOccluder = blockers[k];
+			TRACE_STAT(threadStats.shadowEarlyExits++);
+		}
+	}
+
+	// Stops at the first blocker whose shadow factor is at most stopAt; more transparent blockers
+	// only lower shadow and the search goes on.
+	bool FindOccluder(Ray& ray, float maxDistance, int self, float stopAt, float& shadow)
+	{
+		TRACE_STAT(threadStats.shadowQueries++);
+
+		bool occluded = false;
+		int blocker = -1;
+		shadow = 1;
+
+		auto test = [&](int i) {
+			if (i == self) return false;
+
+			auto hit = prims[i]->CheckRayCollision(ray);
+			if (hit.d < 0 || hit.d > maxDistance) return false;
+
+			occluded = true;
+			shadow = glm::min(shadow, glm::max(materials[i].transparency, minShadow));
+			if (shadow > stopAt) return false;
+
+			blocker = i;
+			return true;
+		};
+
+		const int cached = lastOccluder;
+		if (cached >= 0 && cached < int(prims.size()) && test(cached))
+		{
+			TRACE_STAT(threadStats.shadowCacheHits++);
+			TRACE_STAT(threadStats.shadowEarlyExits++);
+			return true;
+		}
+
+		bool stopped = false;
+		if (useBVH) stopped = bvh.TraverseAny(ray, maxDistance, test);
+		else
+		{
+			for (int i = 0; i < int(prims.size()) && !stopped; i++) stopped = test(i);
+		}
+
+		if (stopped)
+		{
+			lastOccluder = blocker;
+			TRACE_STAT(threadStats.shadowEarlyExits++);
+		}
+
+		return occluded;
+	}
+
+	// The prim a shadow ray from hit may skip: its own when convex. Meshes, sphere sets and
+	// instances are tested like any blocker and rely on MakeShadowRay's offset instead.
+	int ShadowSelf(const Hit& hit) const
+	{
+		return prims[hit.prim]->Convex() ? hit.prim : -1;
+	}
+
+	Ray MakeShadowRay(const Hit& hit)
+	{
+		vec3 DirToLight = glm::normalize(light.pos - hit.point);
+		return Ray{ hit.point + DirToLight * 1e-4f, DirToLight };
+	}
+
+	vec3 Shade(Ray& ray, Hit& hit, bool occluded, float shadow, int recursiveLevel, float throughput = 1.0f)
+	{
+		const Material& material = materials[hit.material];
+
+		vec3 color = ShadeLocal(ray, hit, occluded, shadow);
+		if (recursiveLevel <= 0) return color;
+
+		float scale;
+
+		if (material.reflection) 
+		{
+			Ray reflectRay = ReflectRay(ray, hit);
+			if (KeepBranch(reflectRay, throughput * material.reflection, scale))
+			{
+				TRACE_STAT(threadStats.reflectionRays++);
+				color += traceRay(reflectRay, recursiveLevel - 1, throughput * material.reflection * scale) * material.reflection * scale;
 			}
+		}
 
-			color += phongColor * (1.0f - hit.obj->reflection - hit.obj->transparency);
+		if (material.transparency)
+		{
+			Ray transparencyRay = RefractRay(ray, hit);
+			if (KeepBranch(transparencyRay, throughput * material.transparency, scale))
+			{
+				TRACE_STAT(threadStats.refractionRays++);
+				color += traceRay(transparencyRay, recursiveLevel - 1, throughput * material.transparency * scale) * material.transparency * scale;
+			}
+		}
+
+		return color;
+	}
 
-			if (hit.obj->reflection) 
+	// Whether a branch carrying throughput is traced; scale is what its contribution must be
+	// multiplied by to stay unbiased (1 unless it survived Russian roulette).
+	bool KeepBranch(const Ray& ray, float throughput, float& scale)
+	{
+		scale = 1;
+		if (throughput >= pruneThreshold) return true;
+
+		if (russianRoulette)
+		{
+			const float survival = throughput / pruneThreshold;
+			if (RouletteSample(ray) < survival)
 			{
-				auto reflectDir = glm::normalize(2 * glm::dot(-ray.dir, hit.normal) * hit.normal + ray.dir);
-				Ray reflectRay{ hit.point + reflectDir * 1e-4f, reflectDir };
+				scale = 1 / survival;
+				return true;
+			}
+		}
+
+		TRACE_STAT(threadStats.prunedBranches++);
+		return false;
+	}
+
+	// Uniform [0, 1) from the ray itself, so a render does not depend on which thread traced what.
+	static float RouletteSample(const Ray& ray)
+	{
+		uint32_t h = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			uint32_t start, dir;
+			memcpy(&start, &ray.start[a], sizeof(float));
+			memcpy(&dir, &ray.dir[a], sizeof(float));
+			h = Hash(h ^ start);
+			h = Hash(h ^ dir);
+		}
+		return (h >> 8) / 16777216.0f;
+	}
+
+	// Direct lighting at hit, already weighted by the share left after reflection and transparency.
+	vec3 ShadeLocal(Ray& ray, Hit& hit, bool occluded, float shadow)
+	{
+		const Material& material = materials[hit.material];
+		const float footprint = TextureFootprint(ray, hit);
+
+		vec3 phongColor(0);
+
+		vec3 DirToLight = glm::normalize(light.pos - hit.point);
+
+		if (!occluded) {
+			float diff = glm::max(dot(hit.normal, DirToLight), 0.0f);
+
+			vec3 ReflectDir = 2 * glm::dot(DirToLight, hit.normal) * hit.normal - DirToLight;
+			float spec = glm::pow(glm::max(glm::dot(DirToLight, -ray.dir), 0.0f), material.alpha);
+
+			if (material.ambTexture) phongColor += material.amb * material.ambTexture->Sample(hit.uv, footprint);
+			else phongColor += material.amb;
+
+			if (material.diffTexture) phongColor += material.diff * material.diffTexture->Sample(hit.uv, footprint);
+			else phongColor += diff * material.diff;
+
+			phongColor += material.spec * spec;
+		}
+		else {
+			if (material.ambTexture) phongColor = shadow * material.amb * material.ambTexture->Sample(hit.uv, footprint);
+			else phongColor = shadow * material.amb;
+		}
 
-				color += traceRay(reflectRay, recursiveLevel - 1) * hit.obj->reflection;
+		return phongColor * (1.0f - material.reflection - material.transparency);
+	}
+
+	Ray ReflectRay(const Ray& ray, const Hit& hit)
+	{
+		auto reflectDir = glm::normalize(2 * glm::dot(-ray.dir, hit.normal) * hit.normal + ray.dir);
+		return SecondaryRay(ray, hit, reflectDir, true);
+	}
+
+	Ray RefractRay(const Ray& ray, const Hit& hit)
+	{
+		float eta = 1.5f;
+		vec3 normal = hit.normal;
+
+		if (glm::dot(ray.dir, hit.normal) >= 0) 
+		{
+			eta = 1 / eta;
+			normal = -normal;
+		}
+
+		const float cos1 = glm::dot(-ray.dir, normal);
+		const float sin1 = glm::sqrt(1 - cos1 * cos1);
+		const float sin2 = sin1 / eta;
+		const float cos2 = glm::sqrt(1 - sin2 * sin2);
+
+		const vec3 m = glm::normalize(glm::dot(-ray.dir, normal) * normal + ray.dir); 
+		const vec3 a = cos2 * -normal;
+		const vec3 b = sin2 * m;
+		const vec3 t = glm::normalize(a + b);
+
+		return SecondaryRay(ray, hit, t, false);
+	}
+
+	// Continues ray's cone from hit in direction dir. A convex mirror widens it; refraction keeps
+	// the spread, since a lens may as well focus the cone as widen it.
+	Ray SecondaryRay(const Ray& ray, const Hit& hit, const vec3& dir, bool reflected)
+	{
+		Ray next{ hit.point + dir * 1e-4f, dir };
+
+		next.width = ray.width + ray.spread * hit.d;
+		next.spread = reflected ? ray.spread + 2 * hit.curvature * next.width : ray.spread;
+		return next;
+	}
+
+	// Width of the ray cone where it meets hit, in uv units, stretched where the ray grazes.
+	float TextureFootprint(const Ray& ray, const Hit& hit)
+	{
+		if (!mipmapping || hit.uvScale <= 0) return 0;
+
+		const float cosine = glm::max(glm::abs(glm::dot(ray.dir, hit.normal)), 0.1f);
+		return (ray.width + ray.spread * hit.d) * hit.uvScale / cosine;
+	}
+
+	void Render(Framebuffer& framebuffer)
+	{
+		const FramebufferView target = framebuffer.Lock();
+		if (!target.data) return;
+
+		Render(target);
+		framebuffer.Unlock();
+	}
+
+	void Render(std::vector<glm::vec4>& pixels)
+	{
+		Render(FloatView(pixels));
+	}
+
+	// Writes every pixel of the frame straight into target.
+	void Render(const FramebufferView& target)
+	{
+		RenderRegion(target, TileScheduler::Tile{ 0, 0, width, height });
+	}
+
+	// Render of the pixels in region only, for frames split between processes. target still spans
+	// the whole frame. Adaptive anti-aliasing also writes the center samples of a one pixel border
+	// around region, which it compares the pixels on its edge with.
+	void RenderRegion(const FramebufferView& target, const TileScheduler::Tile& region)
+	{
+		UpdateScene();
+
+		if (wavefront) return RenderWavefront(target, region);
+
+		if (costMetric != CostMetric::None) costBuffer.assign(width * height, 0.0f);
+		else costBuffer.clear();
+
+		const bool adaptive = Adaptive();
+		if (adaptive) primarySamples.resize(size_t(width) * height);
+		lastAdaptive = AdaptiveReport();
+
+		TileScheduler& tiles = Scheduler();
+		vector<TraceStats> stats(tiles.ThreadCount());
+
+		const TileScheduler::Tile traced = adaptive ? TileScheduler::Tile{ glm::max(region.x0 - 1, 0), glm::max(region.y0 - 1, 0),
+			glm::min(region.x1 + 1, width), glm::min(region.y1 + 1, height) } : region;
+
+		tiles.Run(traced, tileSize, [&](const TileScheduler::Tile& tile, int thread) {
+			if (cancelRequested) return;
+
+			const TraceStats before = threadStats;
+
+			if (PacketWidth() > 1 && samplesPerPixel <= 1 && maxDepth >= 0) RenderTilePackets(tile, target);
+			else {
+				for (int i = tile.y0; i < tile.y1; i++) {
+					for (int j = tile.x0; j < tile.x1; j++) {
+						const uint64_t cost = costMetric != CostMetric::None ? CostCounter() : 0;
+						target.Store(j, i, vec4(adaptive ? TraceCenterSample(j, i) : RenderPixel(j, i), 1));
+						if (costMetric != CostMetric::None) costBuffer[j + i * width] = float(CostCounter() - cost);
+					}
+				}
 			}
 
-			if (hit.obj->transparency)
+			stats[thread] += threadStats - before;
+		});
+
+		if (adaptive) RefineEdges(target, region, stats);
+
+		lastStats = std::accumulate(stats.begin(), stats.end(), TraceStats(), [](TraceStats a, const TraceStats& b) { return a += b; });
+	}
+
+	FramebufferView FloatView(std::vector<glm::vec4>& pixels) const
+	{
+		pixels.resize(size_t(width) * height);
+		return FramebufferView(reinterpret_cast<uint8_t*>(pixels.data()), sizeof(vec4) * width, PixelFormat::RGBA32F, width, height);
+	}
+
+	// Running total of this thread's costMetric; pixel costs are differences of two readings.
+	uint64_t CostCounter() const
+	{
+		if (costMetric == CostMetric::Nanoseconds)
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+		if (costMetric == CostMetric::PrimaryRays) return threadStats.primaryRays;
+
+		return threadStats.intersectionTests;
+	}
+
+	bool Adaptive() const
+	{
+		return adaptiveSamples > 1 && samplesPerPixel <= 1;
+	}
+
+	// TracePrimaryRay through the pixel center that also records what the ray hit.
+	vec3 TraceCenterSample(int x, int y)
+	{
+		Ray ray = PrimaryRay(vec2(x, y));
+		TRACE_STAT(threadStats.primaryRays++);
+		Hit hit = FindClosestCollision(ray);
+
+		const vec3 color = ShadePrimary(ray, hit);
+		primarySamples[x + y * width] = PrimarySample{ color, hit.normal, hit.d >= 0 ? hit.prim : -1 };
+		return color;
+	}
+
+	// Test that flags the edge between two center samples, or EdgeReasonCount for none.
+	int EdgeBetween(const PrimarySample& a, const PrimarySample& b) const
+	{
+		if (a.prim != b.prim) return PrimEdge;
+		if (a.prim >= 0 && glm::dot(a.normal, b.normal) < adaptiveNormalCos) return NormalEdge;
+
+		const vec3 d = glm::abs(a.color - b.color);
+		if (glm::max(d.x, glm::max(d.y, d.z)) > adaptiveContrast) return ContrastEdge;
+
+		return EdgeReasonCount;
+	}
+
+	// Second pass of adaptive anti-aliasing, once every center sample is in: refined pixels are
+	// replaced by the mean of their stratified samples.
+	void RefineEdges(const FramebufferView& target, const TileScheduler::Tile& region, vector<TraceStats>& stats)
+	{
+		if (cancelRequested) return;
+
+		int grid = 1;
+		while (grid * grid < adaptiveSamples) grid *= 2;
+		const int first = glm::min(adaptiveSamples, 4);
+
+		TileScheduler& tiles = Scheduler();
+		vector<AdaptiveReport> reports(tiles.ThreadCount());
+
+		tiles.Run(region, tileSize, [&](const TileScheduler::Tile& tile, int thread) {
+			if (cancelRequested) return;
+
+			const TraceStats before = threadStats;
+			AdaptiveReport& report = reports[thread];
+
+			for (int i = tile.y0; i < tile.y1; i++) {
+				for (int j = tile.x0; j < tile.x1; j++) {
+					const PrimarySample& center = primarySamples[j + i * width];
+
+					int reason = EdgeReasonCount;
+					if (j > 0) reason = glm::min(reason, EdgeBetween(center, primarySamples[j - 1 + i * width]));
+					if (j + 1 < width) reason = glm::min(reason, EdgeBetween(center, primarySamples[j + 1 + i * width]));
+					if (i > 0) reason = glm::min(reason, EdgeBetween(center, primarySamples[j + (i - 1) * width]));
+					if (i + 1 < height) reason = glm::min(reason, EdgeBetween(center, primarySamples[j + (i + 1) * width]));
+					if (reason == EdgeReasonCount) continue;
+
+					const uint64_t cost = costMetric != CostMetric::None ? CostCounter() : 0;
+
+					vec3 sum(0), low(1), high(0);
+					int n = 0;
+					for (; n < first; n++) {
+						const vec3 color = TracePrimaryRay(vec2(j, i) + StratifiedOffset(j, i, n, grid));
+						sum += color;
+						low = glm::min(low, color);
+						high = glm::max(high, color);
+					}
+
+					const vec3 spread = high - low;
+					if (n < adaptiveSamples && glm::max(spread.x, glm::max(spread.y, spread.z)) > adaptiveSpread) {
+						for (; n < adaptiveSamples; n++) sum += TracePrimaryRay(vec2(j, i) + StratifiedOffset(j, i, n, grid));
+						report.fullySampled++;
+					}
+
+					target.Store(j, i, vec4(sum / float(n), 1));
+					if (costMetric != CostMetric::None) costBuffer[j + i * width] += float(CostCounter() - cost);
+
+					report.pixels[reason]++;
+					report.extraRays[reason] += n;
+				}
+			}
+
+			stats[thread] += threadStats - before;
+		});
+
+		for (const AdaptiveReport& report : reports) lastAdaptive += report;
+	}
+
+	// Breadth-first alternative to the recursive Render. Each bounce is one queue of rays that is
+	// sorted, traced in packets and shaded, and whose reflection and refraction rays form the next
+	// bounce's queue. The result matches Render up to float rounding.
+	void RenderWavefront(const FramebufferView& target, const TileScheduler::Tile& region)
+	{
+		const int samples = glm::max(samplesPerPixel, 1);
+		const int regionWidth = region.x1 - region.x0;
+		const int regionPixels = regionWidth * (region.y1 - region.y0);
+
+		vector<WavefrontRay> queue, next;
+		queue.reserve(size_t(regionPixels) * samples);
+
+		for (int i = region.y0; i < region.y1; i++) {
+			for (int j = region.x0; j < region.x1; j++) {
+				for (int s = 0; s < samples; s++) {
+					const vec2 pos = samples > 1 ? vec2(j, i) + SampleOffset(j, i, s) : vec2(j, i);
+					Ray pixelRay = PrimaryRay(pos);
+
+					queue.push_back(WavefrontRay{ pixelRay, 1.0f, (j - region.x0 + (i - region.y0) * regionWidth) * samples + s, vec3(0) });
+				}
+			}
+		}
+
+		vector<vec3> radiance(queue.size(), vec3(0));
+		lastQueueSizes.clear();
+
+		TileScheduler& tiles = Scheduler();
+		vector<TraceStats> stats(tiles.ThreadCount());
+
+		for (int bounce = 0; bounce <= maxDepth && !queue.empty() && !cancelRequested; bounce++)
+		{
+			lastQueueSizes.push_back(queue.size());
+			SortWavefront(queue);
+
+			const int chunk = glm::max(wavefrontChunk, 1);
+			const bool spawn = bounce < maxDepth;
+			vector<vector<WavefrontRay>> spawned((queue.size() + chunk - 1) / chunk);
+
+			tiles.RunRange(int(queue.size()), chunk, [&](int begin, int end, int thread) {
+				if (cancelRequested) return;
+
+				const TraceStats before = threadStats;
+				TraceWavefront(queue.data() + begin, end - begin, bounce == 0, spawn, spawned[begin / chunk]);
+				stats[thread] += threadStats - before;
+			});
+
+			for (auto& ray : queue) radiance[ray.slot] += ray.radiance;
+
+			next.clear();
+			for (auto& rays : spawned) next.insert(next.end(), rays.begin(), rays.end());
+			queue.swap(next);
+		}
+
+		for (int p = 0; p < regionPixels && !cancelRequested; p++) {
+			vec3 color(0);
+			for (int s = 0; s < samples; s++) color += glm::clamp(radiance[p * samples + s], 0.0f, 1.0f);
+
+			target.Store(region.x0 + p % regionWidth, region.y0 + p / regionWidth, vec4(samples > 1 ? color / float(samples) : color, 1));
+		}
+
+		lastStats = std::accumulate(stats.begin(), stats.end(), TraceStats(), [](TraceStats a, const TraceStats& b) { return a += b; });
+	}
+
+	void TraceWavefront(WavefrontRay* rays, int count, bool primary, bool spawn, vector<WavefrontRay>& spawned)
+	{
+		const int packetWidth = PacketWidth();
+
+		Ray batch[RayPacket::maxWidth];
+		Hit hits[RayPacket::maxWidth];
+
+		for (int first = 0; first < count; first += packetWidth)
+		{
+			const int n = glm::min(packetWidth, count - first);
+			for (int k = 0; k < n; k++) batch[k] = rays[first + k].ray;
+
+			if (primary) TRACE_STAT(threadStats.primaryRays += n);
+			FindClosestCollisionPacket(batch, n, hits);
+
+			for (int k = 0; k < n; k++)
 			{
-				float eta = 1.5f;
-				vec3 normal = hit.normal;
+				WavefrontRay& w = rays[first + k];
+				Hit& hit = hits[k];
+				if (hit.d < 0) {
+					w.radiance = Background(w.ray) * w.weight;
+					continue;
+				}
+
+				float shadow;
+				const bool occluded = LightOccluded(hit, shadow);
+				w.radiance = ShadeLocal(w.ray, hit, occluded, shadow) * w.weight;
+
+				if (!spawn) continue;
 
-				if (glm::dot(ray.dir, hit.normal) >= 0) 
+				const Material& material = materials[hit.material];
+				float scale;
+
+				if (material.reflection)
+				{
+					Ray reflectRay = ReflectRay(w.ray, hit);
+					if (KeepBranch(reflectRay, w.weight * material.reflection, scale))
+					{
+						TRACE_STAT(threadStats.reflectionRays++);
+						spawned.push_back(WavefrontRay{ reflectRay, w.weight * material.reflection * scale, w.slot, vec3(0) });
+					}
+				}
+
+				if (material.transparency)
 				{
-					eta = 1 / eta;
-					normal = -normal;
+					Ray transparencyRay = RefractRay(w.ray, hit);
+					if (KeepBranch(transparencyRay, w.weight * material.transparency, scale))
+					{
+						TRACE_STAT(threadStats.refractionRays++);
+						spawned.push_back(WavefrontRay{ transparencyRay, w.weight * material.transparency * scale, w.slot, vec3(0) });
+					}
 				}
+			}
+		}
+	}
 
-				const float cos1 = glm::dot(-ray.dir, normal);
-				const float sin1 = glm::sqrt(1 - cos1 * cos1);
-				const float sin2 = sin1 / eta;
-				const float cos2 = glm::sqrt(1 - sin2 * sin2);
+	void SortWavefront(vector<WavefrontRay>& queue)
+	{
+		const AABB bounds = bvh.IsEmpty() ? AABB(vec3(-1), vec3(1)) : bvh.nodes[0].bounds;
 
-				const vec3 m = glm::normalize(glm::dot(-ray.dir, normal) * normal + ray.dir); 
-				const vec3 a = cos2 * -normal;
-				const vec3 b = sin2 * m;
-				const vec3 t = glm::normalize(a + b);
+		vector<std::pair<uint32_t, int>> keys(queue.size());
+		for (size_t i = 0; i < queue.size(); i++) keys[i] = { WavefrontKey(queue[i].ray, bounds), int(i) };
 
-				Ray transparencyRay{ hit.point + t * 1e-4f, t };
-				color += traceRay(transparencyRay, recursiveLevel - 1) * hit.obj->transparency;
-			}
+		std::sort(keys.begin(), keys.end());
+
+		vector<WavefrontRay> sorted(queue.size());
+		for (size_t i = 0; i < keys.size(); i++) sorted[i] = queue[keys[i].second];
+		queue.swap(sorted);
+	}
+
+	// Direction octant in the top 3 bits so packets agree on traversal order, then a 15-bit Morton
+	// code of the origin within bounds, then the quantized x and y of the direction.
+	static uint32_t WavefrontKey(const Ray& ray, const AABB& bounds)
+	{
+		const uint32_t octant = uint32_t(ray.dir.x < 0) | uint32_t(ray.dir.y < 0) << 1 | uint32_t(ray.dir.z < 0) << 2;
+
+		const vec3 cell = glm::clamp((ray.start - bounds.lower) / glm::max(bounds.upper - bounds.lower, vec3(1e-6f)), 0.0f, 0.999f) * 32.0f;
+		uint32_t origin = 0;
+		for (int b = 0; b < 5; b++)
+			for (int a = 0; a < 3; a++) origin |= ((uint32_t(cell[a]) >> b) & 1) << (b * 3 + a);
+
+		const uint32_t dx = uint32_t(glm::min(glm::abs(ray.dir.x), 0.999f) * 128.0f);
+		const uint32_t dy = uint32_t(glm::min(glm::abs(ray.dir.y), 0.999f) * 128.0f);
+
+		return octant << 29 | origin << 14 | dx << 7 | dy;
+	}
+
+	void ResetProgressive()
+	{
+		accumulation.assign(width * height, vec3(0));
+		sampleCounts.assign(width * height, 0);
+		progressiveCamera = camera;
+		progressiveScene = sceneVersion;
+		progressiveTarget = 1;
+	}
+
+	bool ProgressiveConverged() const
+	{
+		return progressiveTarget > maxProgressiveSamples;
+	}
+
+	void RenderProgressive(Framebuffer& framebuffer, double budgetSeconds)
+	{
+		const FramebufferView target = framebuffer.Lock();
+		if (!target.data) return;
+
+		RenderProgressive(target, budgetSeconds, framebuffer.Persistent());
+		framebuffer.Unlock();
+	}
+
+	void RenderProgressive(std::vector<glm::vec4>& pixels, double budgetSeconds)
+	{
+		RenderProgressive(FloatView(pixels), budgetSeconds, true);
+	}
+
+	// Adds one jittered sample per pixel per pass until budgetSeconds runs out. Tiles that no longer
+	// fit are left for the next call. A persistent target gets each pixel as it is refined, any
+	// other target the whole running average once the budget is spent. The average starts over
+	// when the camera or the scene has changed since it began; call ResetProgressive after changing
+	// lights or render settings.
+	void RenderProgressive(const FramebufferView& target, double budgetSeconds, bool persistent)
+	{
+		using Clock = std::chrono::steady_clock;
+		const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(budgetSeconds));
+
+		UpdateScene();
+
+		if (accumulation.size() != size_t(width) * height || progressiveCamera != camera || progressiveScene != sceneVersion) ResetProgressive();
+
+		TileScheduler& tiles = Scheduler();
+		vector<TraceStats> stats(tiles.ThreadCount());
 
-			return color;
+		while (!ProgressiveConverged() && Clock::now() < deadline && !cancelRequested)
+		{
+			std::atomic<bool> expired(false);
+
+			tiles.Run(width, height, tileSize, [&](const TileScheduler::Tile& tile, int thread) {
+				if (Clock::now() >= deadline || cancelRequested) {
+					expired = true;
+					return;
+				}
+
+				const TraceStats before = threadStats;
+
+				// pixels carry their own counts, so tiles of an earlier call's size may be part done
+				for (int i = tile.y0; i < tile.y1; i++) {
+					for (int j = tile.x0; j < tile.x1; j++) {
+						const int index = j + i * width;
+						const int k = sampleCounts[index];
+						if (k >= progressiveTarget) continue;
+
+						accumulation[index] += TracePrimaryRay(vec2(j, i) + ProgressiveOffset(j, i, k));
+						sampleCounts[index] = k + 1;
+						if (persistent) target.Store(j, i, vec4(accumulation[index] / float(k + 1), 1));
+					}
+				}
+
+				stats[thread] += threadStats - before;
+			});
+
+			if (!expired) progressiveTarget++;
 		}
 
-		return vec3(0);
+		if (!persistent) {
+			tiles.Run(width, height, tileSize, [&](const TileScheduler::Tile& tile, int) {
+				for (int i = tile.y0; i < tile.y1; i++) {
+					for (int j = tile.x0; j < tile.x1; j++) {
+						const int index = j + i * width;
+						const int k = sampleCounts[index];
+						target.Store(j, i, vec4(k > 0 ? accumulation[index] / float(k) : vec3(0), 1));
+					}
+				}
+			});
+		}
+
+		lastStats = std::accumulate(stats.begin(), stats.end(), TraceStats(), [](TraceStats a, const TraceStats& b) { return a += b; });
 	}
 
-	void Render(std::vector<glm::vec4>& pixels)
+	void RenderReprojected(Framebuffer& framebuffer)
 	{
-		std::fill(pixels.begin(), pixels.end(), vec4(0, 0, 0, 1));
-		
-		vec3 eyePos(0, 0, -1.5f);
+		const FramebufferView target = framebuffer.Lock();
+		if (!target.data) return;
 
-#pragma omp parallel for
-		for (int i = 0; i < height; i++) {
-			for (int j = 0; j < width; j++) {
-				vec3 pixelPosWorld = TransformScreenToWorld(vec2(j, i));
-				Ray pixelRay{ pixelPosWorld, glm::normalize(pixelPosWorld - eyePos) };
-				pixels[j + i * width] = vec4(glm::clamp(traceRay(pixelRay, 5), 0.0f, 1.0f), 1);
+		RenderReprojected(target);
+		framebuffer.Unlock();
+	}
+
+	// Render for a moving camera. The previous frame's hits are projected into the new view, and a
+	// pixel that one lands on keeps the cached color if its ray still meets that hit's prim close to
+	// where it was shaded and nothing is in front, which an any-hit query up to the hit settles.
+	// Pixels nothing lands on, and those that fail the test, are traced and shaded in full. Lights,
+	// materials and render settings are not tracked: call InvalidateReprojection after changing
+	// them. Scene edits are tracked.
+	void RenderReprojected(const FramebufferView& target)
+	{
+		UpdateScene();
+
+		const size_t pixels = size_t(width) * height;
+		const bool valid = reprojection.size() == pixels && reprojectionScene == sceneVersion;
+		reprojected.resize(pixels);
+
+		TileScheduler& tiles = Scheduler();
+		if (valid) ScatterReprojection(tiles);
+
+		vector<TraceStats> stats(tiles.ThreadCount());
+		vector<int> retraced(tiles.ThreadCount(), 0), covered(tiles.ThreadCount(), 0);
+
+		tiles.Run(width, height, tileSize, [&](const TileScheduler::Tile& tile, int thread) {
+			if (cancelRequested) return;
+
+			const TraceStats before = threadStats;
+
+			for (int i = tile.y0; i < tile.y1; i++) {
+				for (int j = tile.x0; j < tile.x1; j++) {
+					Ray ray = PixelRay(j, i);
+					TRACE_STAT(threadStats.primaryRays++);
+
+					CachedPixel& pixel = reprojected[j + i * width];
+					const uint64_t source = valid ? scattered[j + i * width].load(std::memory_order_relaxed) : noSource;
+
+					if (source != noSource && Revalidate(ray, reprojection[uint32_t(source)])) pixel = reprojection[uint32_t(source)];
+					else {
+						Hit hit = FindClosestCollision(ray);
+						pixel.color = RenderPixel(j, i, ray, hit);
+						pixel.point = hit.point;
+						pixel.eye = camera.position;
+						pixel.prim = hit.d >= 0 ? hit.prim : -1;
+
+						if (hit.d >= 0) retraced[thread]++;
+					}
+
+					if (pixel.prim >= 0) covered[thread]++;
+					target.Store(j, i, vec4(pixel.color, 1));
+				}
 			}
+
+			stats[thread] += threadStats - before;
+		});
+
+		if (cancelRequested) reprojection.clear();
+		else {
+			reprojection.swap(reprojected);
+			reprojectionScene = sceneVersion;
 		}
+
+		const int coveredPixels = std::accumulate(covered.begin(), covered.end(), 0);
+		lastRetraceRatio = coveredPixels > 0 ? float(std::accumulate(retraced.begin(), retraced.end(), 0)) / coveredPixels : 0;
+		lastStats = std::accumulate(stats.begin(), stats.end(), TraceStats(), [](TraceStats a, const TraceStats& b) { return a += b; });
 	}
 
-	vec3 TransformScreenToWorld(vec2 pos)
+	void InvalidateReprojection()
 	{
-		float x = 2.0f / width;
-		float y = 2.0f / height;
-		float aspect = (float)width / height;
+		reprojection.clear();
+	}
+
+	// Forward-projects every cached hit into the current camera and keeps, per pixel, the one
+	// nearest the eye among those rounding to it.
+	void ScatterReprojection(TileScheduler& tiles)
+	{
+		const size_t pixels = size_t(width) * height;
+		if (scatteredSize != pixels)
+		{
+			scattered = make_unique<std::atomic<uint64_t>[]>(pixels);
+			scatteredSize = pixels;
+		}
+		for (size_t k = 0; k < pixels; k++) scattered[k].store(noSource, std::memory_order_relaxed);
 
-		return vec3((pos.x * x - 1) * aspect, -pos.y * y + 1, 0);
+		tiles.RunRange(int(pixels), 4096, [&](int begin, int end, int) {
+			for (int k = begin; k < end; k++) {
+				const CachedPixel& cached = reprojection[k];
+				vec2 pos;
+				if (cached.prim < 0 || !camera.WorldToScreen(cached.point, width, height, pos)) continue;
+
+				const int x = int(glm::floor(pos.x + 0.5f));
+				const int y = int(glm::floor(pos.y + 0.5f));
+				if (x < 0 || y < 0 || x >= width || y >= height) continue;
+
+				// positive floats order like their bits, so the smallest key is the nearest point
+				const float depth = glm::distance(camera.position, cached.point);
+				uint32_t bits;
+				std::memcpy(&bits, &depth, sizeof(bits));
+				const uint64_t key = uint64_t(bits) << 32 | uint32_t(k);
+
+				std::atomic<uint64_t>& slot = scattered[x + y * width];
+				uint64_t current = slot.load(std::memory_order_relaxed);
+				while (key < current && !slot.compare_exchange_weak(current, key, std::memory_order_relaxed)) {}
+			}
+		});
 	}
 
-	void CubeMap() {
-		auto groundTexture = std::make_shared<Texture>("negy.jpg");
+	// Whether cached can stand in for shading ray: ray must meet cached's prim within
+	// reprojectionTolerance footprints of where cached was shaded, from nearly the same direction if
+	// the material looks different from elsewhere, and meet nothing else before it.
+	bool Revalidate(Ray& ray, const CachedPixel& cached)
+	{
+		const Hit hit = prims[cached.prim]->CheckRayCollision(ray);
+		TRACE_STAT(threadStats.intersectionTests++);
+		if (hit.d < 0) return false;
 
-		auto ground = make_shared<Square>(vec3(-10.0f, -1.5f, 10.0f), vec3(10.0f, -1.5f, 10.0f), vec3(10.0f, -1.5f, -10.0f), vec3(-10.0f, -1.5f, -10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+		const float cosine = glm::max(glm::abs(glm::dot(ray.dir, hit.normal)), 0.2f);
+		const float footprint = (ray.width + ray.spread * hit.d) / cosine;
+		if (glm::distance(cached.point, hit.point) > reprojectionTolerance * footprint) return false;
 
-		ground->amb = vec3(1.0f);
-		ground->diff = vec3(0.0f);
-		ground->spec = vec3(0.0f);
-		ground->alpha = 10.0f;
-		ground->reflection = 0.05f;
-		ground->ambTexture = groundTexture;
-		ground->diffTexture = groundTexture;
+		// mirrored and refracted images move with any step of the eye; highlights drift slowly
+		const Material& material = materials[cached.prim];
+		if (material.reflection + material.transparency > reprojectionMaxReflection && cached.eye != camera.position) return false;
+		if (material.spec != vec3(0) && glm::dot(glm::normalize(cached.eye - cached.point), -ray.dir) < glm::cos(reprojectionMaxAngle)) return false;
 
-		objects.push_back(ground);
+		// anything else in front, such as geometry hidden or off screen last frame, takes the pixel
+		const float tMax = hit.d * (1 - 1e-4f);
+		auto nearer = [&](int i) {
+			if (i == cached.prim) return false;
 
-		auto forwardTexture = std::make_shared<Texture>("posz.jpg");
+			TRACE_STAT(threadStats.intersectionTests++);
+			const Hit other = prims[i]->CheckRayCollision(ray);
+			return other.d >= 0 && other.d < tMax;
+		};
 
-		auto forward = make_shared<Square>(vec3(-10.0f, 15.0f, 10.0f), vec3(10.0f, 15.0f, 10.0f), vec3(10.0f, -5.0f, 10.0f), vec3(-10.0f, -5.0f, 10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+		if (useBVH) return !bvh.TraverseAny(ray, tMax, nearer);
 
-		forward->amb = vec3(1.0f);
-		forward->diff = vec3(0.0f);
-		forward->spec = vec3(0.0f);
-		forward->alpha = 10.0f;
-		forward->reflection = 0.0f;
-		forward->ambTexture = forwardTexture;
-		forward->diffTexture = forwardTexture;
+		for (int i = 0; i < int(prims.size()); i++)
+			if (nearer(i)) return false;
+		return true;
+	}
 
-		objects.push_back(forward);
+	// TracePrimaryRay for a ray whose closest hit is already known.
+	vec3 ShadePrimary(Ray& ray, Hit& hit)
+	{
+		if (maxDepth < 0) return vec3(0);
+		if (hit.d < 0) return glm::clamp(Background(ray), 0.0f, 1.0f);
 
-		auto rightTexture = std::make_shared<Texture>("posx.jpg");
+		float shadow;
+		const bool occluded = LightOccluded(hit, shadow);
+		return glm::clamp(Shade(ray, hit, occluded, shadow, maxDepth), 0.0f, 1.0f);
+	}
 
-		auto right = make_shared<Square>(vec3(10.0f, 15.0f, 10.0f), vec3(10.0f, 15.0f, -10.0f), vec3(10.0f, -5.0f, -10.0f), vec3(10.0f, -5.0f, 10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+	TileScheduler& Scheduler()
+	{
+		const int requested = threadCount > 0 ? threadCount : glm::max(int(std::thread::hardware_concurrency()), 1);
+		if (!scheduler || scheduler->ThreadCount() != requested) scheduler = make_unique<TileScheduler>(requested);
 
-		right->amb = vec3(1.0f);
-		right->diff = vec3(0.0f);
-		right->spec = vec3(0.0f);
-		right->alpha = 10.0f;
-		right->reflection = 0.0f;
-		right->ambTexture = rightTexture;
-		right->diffTexture = rightTexture;
+		return *scheduler;
+	}
 
-		objects.push_back(right);
+	vec3 RenderPixel(int x, int y)
+	{
+		if (samplesPerPixel <= 1) return TracePrimaryRay(vec2(x, y));
 
-		auto backTexture = std::make_shared<Texture>("negz.jpg");
+		vec3 color(0);
+		for (int s = 0; s < samplesPerPixel; s++)
+			color += TracePrimaryRay(vec2(x, y) + SampleOffset(x, y, s));
 
-		auto back = make_shared<Square>(vec3(10.0f, 15.0f, -10.0f), vec3(-10.0f, 15.0f, -10.0f), vec3(-10.0f, -5.0f, -10.0f), vec3(10.0f, -5.0f, -10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+		return color / float(samplesPerPixel);
+	}
 
-		back->amb = vec3(1.0f);
-		back->diff = vec3(0.0f);
-		back->spec = vec3(0.0f);
-		back->alpha = 10.0f;
-		back->reflection = 0.0f;
-		back->ambTexture = backTexture;
-		back->diffTexture = backTexture;
+	// RenderPixel for a pixel whose first sample, ray = PixelRay(x, y), is known to hit hit.
+	vec3 RenderPixel(int x, int y, Ray& ray, Hit& hit)
+	{
+		vec3 color = ShadePrimary(ray, hit);
+		for (int s = 1; s < samplesPerPixel; s++)
+			color += TracePrimaryRay(vec2(x, y) + SampleOffset(x, y, s));
 
-		objects.push_back(back);
+		return color / float(glm::max(samplesPerPixel, 1));
+	}
 
-		auto leftTexture = std::make_shared<Texture>("negx.jpg");
+	// The ray of the first sample RenderPixel takes of pixel (x, y).
+	Ray PixelRay(int x, int y)
+	{
+		return PrimaryRay(samplesPerPixel <= 1 ? vec2(x, y) : vec2(x, y) + SampleOffset(x, y, 0));
+	}
 
-		auto left = make_shared<Square>(vec3(-10.0f, 15.0f, -10.0f), vec3(-10.0f, 15.0f, 10.0f), vec3(-10.0f, -5.0f, 10.0f), vec3(-10.0f, -5.0f, -10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+	vec3 TracePrimaryRay(vec2 pos)
+	{
+		Ray pixelRay = PrimaryRay(pos);
+		TRACE_STAT(threadStats.primaryRays++);
+		return glm::clamp(traceRay(pixelRay, maxDepth), 0.0f, 1.0f);
+	}
 
-		left->amb = vec3(1.0f);
-		left->diff = vec3(0.0f);
-		left->spec = vec3(0.0f);
-		left->alpha = 10.0f;
-		left->reflection = 0.0f;
-		left->ambTexture = leftTexture;
-		left->diffTexture = leftTexture;
+	// Ray through screen position pos whose cone covers one pixel.
+	Ray PrimaryRay(vec2 pos)
+	{
+		vec3 pixelPosWorld = camera.ScreenToWorld(pos, width, height);
+		Ray ray{ pixelPosWorld, glm::normalize(pixelPosWorld - camera.position) };
 
-		objects.push_back(left);
+		ray.width = 2.0f / height;
+		ray.spread = ray.width / glm::length(pixelPosWorld - camera.position);
+		return ray;
+	}
 
-		auto topTexture = std::make_shared<Texture>("posy.jpg");
+	// Stratified jitter in [-0.5, 0.5)^2 around the pixel, deterministic per (pixel, sample).
+	vec2 SampleOffset(int x, int y, int s)
+	{
+		const int n = int(glm::ceil(glm::sqrt(float(samplesPerPixel))));
+		const uint32_t seed = Hash(uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(s) * 83492791u);
+		const float jx = (seed & 0xffff) / 65536.0f;
+		const float jy = (seed >> 16) / 65536.0f;
 
-		auto top = make_shared<Square>(vec3(-10.0f, 10.0f, -10.0f), vec3(10.0f, 10.0f, -10.0f), vec3(10.0f, 10.0f, 10.0f), vec3(-10.0f, 10.0f, 10.0f),
-			vec2(0.0f, 0.0f), vec2(1.0f, 0.0f), vec2(1.0f, 1.0f), vec2(0.0f, 1.0f));
+		return vec2((s % n + jx) / n, (s / n % n + jy) / n) - vec2(0.5f);
+	}
+
+	// Sample s of an Owen-scrambled grid x grid stratification, grid a power of two, jittered in its
+	// cell. Every prefix of 4^k samples has one sample in each cell of the 2^k x 2^k grid, so a pixel
+	// can stop after four samples and still be stratified.
+	vec2 StratifiedOffset(int x, int y, int s, int grid)
+	{
+		const uint32_t seed = Hash(uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u);
 
-		top->amb = vec3(1.0f);
-		top->diff = vec3(0.0f);
-		top->spec = vec3(0.0f);
-		top->alpha = 10.0f;
-		top->reflection = 0.0f;
-		top->ambTexture = topTexture;
-		top->diffTexture = topTexture;
+		int cx = 0, cy = 0;
+		uint32_t cell = 1;
+		for (int half = grid / 2, digits = s; half > 0; half /= 2, digits >>= 2) {
+			const int digit = (digits & 3) ^ int(Hash(seed ^ cell * 0x9e3779b9u) & 3);
+			cx += (digit & 1) * half;
+			cy += (digit >> 1) * half;
+			cell = cell * 4 + digit;
+		}
+
+		const uint32_t jitter = Hash(seed ^ uint32_t(s) * 83492791u ^ cell);
+		const vec2 j((jitter & 0xffff) / 65536.0f, (jitter >> 16) / 65536.0f);
+
+		return (vec2(cx, cy) + j) / float(grid) - vec2(0.5f);
+	}
 
-		objects.push_back(top);
+	// First sample hits the same spot as Render; later ones follow an R2 sequence rotated per pixel.
+	vec2 ProgressiveOffset(int x, int y, int k)
+	{
+		if (k == 0) return vec2(0);
+
+		const uint32_t seed = Hash(uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u);
+		const vec2 rotation((seed & 0xffff) / 65536.0f, (seed >> 16) / 65536.0f);
+
+		return glm::fract(rotation + float(k) * vec2(0.7548776662f, 0.5698402910f)) - vec2(0.5f);
+	}
+
+	static uint32_t Hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,361 @@
+#include "RenderCluster.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+
+namespace
+{
+	// Every message is a MessageHeader followed by size bytes of payload.
+	enum MessageType : uint32_t
+	{
+		JobMessage = 1,    // coordinator: uint32 width, height and PixelFormat, then the job
+		ReadyMessage = 2,  // worker: the job is set up
+		TileMessage = 3,   // coordinator: render the TileScheduler::Tile in the payload
+		ResultMessage = 4, // worker: TraceStats, then the tile's rows of pixels
+		DoneMessage = 5,   // coordinator: the frame is finished
+	};
+
+	struct MessageHeader
+	{
+		uint32_t type;
+		uint32_t tile;
+		uint64_t size;
+	};
+
+	// Larger payloads are taken for a corrupt stream.
+	const uint64_t maxPayload = uint64_t(1) << 32;
+
+	using Clock = std::chrono::steady_clock;
+
+	bool SendMessage(Socket& socket, MessageType type, uint32_t tile, const void* payload = nullptr, size_t size = 0)
+	{
+		const MessageHeader header{ type, tile, size };
+		return socket.Send(&header, sizeof(header)) && (size == 0 || socket.Send(payload, size));
+	}
+
+	bool ReceiveMessage(Socket& socket, MessageHeader& header, std::string& payload)
+	{
+		if (!socket.Receive(&header, sizeof(header)) || header.size > maxPayload) return false;
+
+		payload.resize(size_t(header.size));
+		return header.size == 0 || socket.Receive(&payload[0], payload.size());
+	}
+
+	double Seconds(Clock::duration duration)
+	{
+		return std::chrono::duration<double>(duration).count();
+	}
+}
+
+bool RenderCoordinator::Listen(const std::string& address)
+{
+	if (listener.Listen(address)) return true;
+
+	std::cout << "Failed to listen on " << address << ": " << strerror(errno) << std::endl;
+	return false;
+}
+
+bool RenderCoordinator::Render(const std::string& job, MemoryFramebuffer& frame)
+{
+	const auto start = Clock::now();
+	lastReport = Report();
+
+	std::vector<TileScheduler::Tile> tiles;
+	const int size = glm::max(tileSize, 1);
+	for (int y = 0; y < frame.height; y += size)
+		for (int x = 0; x < frame.width; x += size)
+			tiles.push_back(TileScheduler::Tile{ x, y, glm::min(x + size, frame.width), glm::min(y + size, frame.height) });
+
+	const int tileCount = int(tiles.size());
+	std::vector<bool> done(tileCount, false);
+	std::vector<int> copies(tileCount, 0); // copies outstanding on workers
+	std::deque<int> pending;
+	for (int t = 0; t < tileCount; t++) pending.push_back(t);
+
+	int remaining = tileCount;
+	double tileSeconds = 0;
+
+	std::string jobMessage(sizeof(uint32_t) * 3, '\0');
+	const uint32_t header[3] = { uint32_t(frame.width), uint32_t(frame.height), uint32_t(frame.format) };
+	memcpy(&jobMessage[0], header, sizeof(header));
+	jobMessage += job;
+
+	struct Assignment
+	{
+		int tile;
+		Clock::time_point sent;
+	};
+
+	struct Connection
+	{
+		Socket socket;
+		int report;
+		bool ready = false;
+		bool dead = false;
+		std::vector<Assignment> assigned;
+		Clock::time_point heard, firstTile;
+		bool started = false;
+	};
+	std::vector<Connection> connections;
+
+	auto send = [&](Connection& connection, int t) {
+		if (!SendMessage(connection.socket, TileMessage, uint32_t(t), &tiles[t], sizeof(tiles[t])))
+		{
+			connection.dead = true;
+			return;
+		}
+
+		const auto now = Clock::now();
+		if (connection.assigned.empty()) connection.heard = now;
+		if (!connection.started) connection.firstTile = now;
+		connection.started = true;
+
+		connection.assigned.push_back(Assignment{ t, now });
+		copies[t]++;
+	};
+
+	const size_t rowBytes = size_t(PixelSize(frame.format));
+	const FramebufferView view = frame.View();
+
+	Clock::time_point alone = start;
+	std::string payload;
+
+	while (remaining > 0)
+	{
+		std::vector<pollfd> fds(1 + connections.size());
+		fds[0] = pollfd{ listener.Handle(), POLLIN, 0 };
+		for (size_t c = 0; c < connections.size(); c++) fds[c + 1] = pollfd{ connections[c].socket.Handle(), POLLIN, 0 };
+
+		if (poll(fds.data(), nfds_t(fds.size()), 50) < 0 && errno != EINTR) return false;
+
+		if (fds[0].revents & POLLIN)
+		{
+			Socket socket = listener.Accept();
+			if (socket.Valid())
+			{
+				socket.SetReceiveTimeout(workerTimeout);
+				if (SendMessage(socket, JobMessage, 0, jobMessage.data(), jobMessage.size()))
+				{
+					Connection connection;
+					connection.socket = std::move(socket);
+					connection.report = int(lastReport.workers.size());
+					lastReport.workers.push_back(WorkerReport());
+					connections.push_back(std::move(connection));
+				}
+			}
+		}
+
+		const auto now = Clock::now();
+
+		for (size_t c = 0; c < connections.size() && c + 1 < fds.size(); c++)
+		{
+			Connection& connection = connections[c];
+			if (!(fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+			MessageHeader message;
+			if (!ReceiveMessage(connection.socket, message, payload))
+			{
+				connection.dead = true;
+				continue;
+			}
+			connection.heard = now;
+
+			if (message.type == ReadyMessage)
+			{
+				connection.ready = true;
+				continue;
+			}
+
+			auto assignment = connection.assigned.begin();
+			while (assignment != connection.assigned.end() && assignment->tile != int(message.tile)) ++assignment;
+
+			if (message.type != ResultMessage || assignment == connection.assigned.end())
+			{
+				connection.dead = true;
+				continue;
+			}
+
+			const int t = assignment->tile;
+			const Clock::time_point sent = assignment->sent;
+			connection.assigned.erase(assignment);
+			copies[t]--;
+
+			if (done[t])
+			{
+				lastReport.duplicates++;
+				continue;
+			}
+
+			const TileScheduler::Tile& tile = tiles[t];
+			const size_t bytes = size_t(tile.x1 - tile.x0) * rowBytes;
+			if (payload.size() != sizeof(TraceStats) + bytes * (tile.y1 - tile.y0))
+			{
+				connection.dead = true;
+				continue;
+			}
+
+			TraceStats stats;
+			memcpy(&stats, payload.data(), sizeof(stats));
+			lastReport.stats += stats;
+
+			const char* pixels = payload.data() + sizeof(stats);
+			for (int y = tile.y0; y < tile.y1; y++, pixels += bytes) memcpy(view.data + view.pitch * y + tile.x0 * rowBytes, pixels, bytes);
+
+			done[t] = true;
+			remaining--;
+			tileSeconds += Seconds(now - sent);
+			lastReport.tiles++;
+
+			WorkerReport& report = lastReport.workers[connection.report];
+			report.tiles++;
+			report.busy = Seconds(now - connection.firstTile);
+		}
+
+		for (auto& connection : connections)
+		{
+			if (!connection.assigned.empty() && Seconds(now - connection.heard) > workerTimeout) connection.dead = true;
+		}
+
+		// tiles held only by lost workers go back to the front of the queue
+		for (auto& connection : connections)
+		{
+			if (!connection.dead) continue;
+
+			for (const Assignment& assignment : connection.assigned)
+			{
+				if (--copies[assignment.tile] > 0 || done[assignment.tile]) continue;
+
+				pending.push_front(assignment.tile);
+				lastReport.redispatched++;
+			}
+
+			lastReport.workers[connection.report].lost = true;
+			std::cout << "cluster: lost worker " << connection.report << ", " << connection.assigned.size() << " tiles outstanding" << std::endl;
+		}
+		connections.erase(std::remove_if(connections.begin(), connections.end(), [](const Connection& c) { return c.dead; }), connections.end());
+
+		for (auto& connection : connections)
+		{
+			if (!connection.ready) continue;
+
+			while (!connection.dead && int(connection.assigned.size()) < glm::max(tilesInFlight, 1) && !pending.empty())
+			{
+				const int t = pending.front();
+				pending.pop_front();
+
+				send(connection, t);
+				if (connection.dead) pending.push_front(t);
+			}
+
+			// an idle worker also takes the slowest tile still out, once none are left to hand out
+			if (connection.dead || !pending.empty() || !connection.assigned.empty() || lastReport.tiles == 0) continue;
+
+			const double limit = stragglerFactor * tileSeconds / lastReport.tiles;
+			int slowest = -1;
+			Clock::time_point oldest = now;
+			for (auto& other : connections)
+			{
+				for (const Assignment& assignment : other.assigned)
+				{
+					if (done[assignment.tile] || copies[assignment.tile] > 1 || assignment.sent >= oldest || Seconds(now - assignment.sent) < limit) continue;
+
+					slowest = assignment.tile;
+					oldest = assignment.sent;
+				}
+			}
+
+			if (slowest < 0) continue;
+
+			send(connection, slowest);
+			if (!connection.dead) lastReport.redispatched++;
+		}
+
+		if (!connections.empty()) alone = now;
+		else if (Seconds(now - alone) > waitTimeout)
+		{
+			std::cout << "cluster: no worker connected for " << waitTimeout << " s, " << remaining << " of " << tileCount << " tiles unfinished" << std::endl;
+			return false;
+		}
+	}
+
+	for (auto& connection : connections) SendMessage(connection.socket, DoneMessage, 0);
+
+	lastReport.seconds = Seconds(Clock::now() - start);
+	return true;
+}
+
+bool RenderWorker::Run(const std::string& address, const std::function<std::unique_ptr<Raytracer>(const std::string& job)>& setup)
+{
+	const auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(connectTimeout));
+
+	Socket socket;
+	while (!socket.Connect(address))
+	{
+		if (Clock::now() >= deadline)
+		{
+			std::cout << "Failed to connect to " << address << ": " << strerror(errno) << std::endl;
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	std::unique_ptr<Raytracer> raytracer;
+	std::unique_ptr<MemoryFramebuffer> frame;
+	std::vector<char> result;
+	bool closed = false;
+
+	MessageHeader message;
+	std::string payload;
+	while (ReceiveMessage(socket, message, payload))
+	{
+		if (message.type == DoneMessage) return true;
+
+		if (message.type == JobMessage)
+		{
+			uint32_t header[3];
+			if (payload.size() < sizeof(header)) return false;
+			memcpy(header, payload.data(), sizeof(header));
+
+			raytracer = setup(payload.substr(sizeof(header)));
+			if (!raytracer || raytracer->width != int(header[0]) || raytracer->height != int(header[1]) || header[2] > uint32_t(PixelFormat::RGBA8_SRGB))
+			{
+				std::cout << "Failed to set up the job from " << address << std::endl;
+				return false;
+			}
+
+			frame = std::make_unique<MemoryFramebuffer>(raytracer->width, raytracer->height, PixelFormat(header[2]));
+			if (!SendMessage(socket, ReadyMessage, 0)) return false;
+			continue;
+		}
+
+		TileScheduler::Tile tile;
+		if (message.type != TileMessage || !raytracer || payload.size() != sizeof(tile)) return false;
+		memcpy(&tile, payload.data(), sizeof(tile));
+
+		if (tile.x0 < 0 || tile.y0 < 0 || tile.x1 > frame->width || tile.y1 > frame->height || tile.x0 >= tile.x1 || tile.y0 >= tile.y1) return false;
+
+		// once results no longer go through, only look for the Done queued behind the tiles
+		if (closed) continue;
+
+		if (tileDelay > 0) std::this_thread::sleep_for(std::chrono::duration<double>(tileDelay));
+
+		const FramebufferView view = frame->View();
+		raytracer->RenderRegion(view, tile);
+
+		const size_t bytes = size_t(tile.x1 - tile.x0) * PixelSize(frame->format);
+		result.resize(sizeof(TraceStats) + bytes * (tile.y1 - tile.y0));
+		memcpy(result.data(), &raytracer->lastStats, sizeof(TraceStats));
+
+		char* pixels = result.data() + sizeof(TraceStats);
+		for (int y = tile.y0; y < tile.y1; y++, pixels += bytes) memcpy(pixels, view.data + view.pitch * y + tile.x0 * PixelSize(frame->format), bytes);
+
+		closed = !SendMessage(socket, ResultMessage, message.tile, result.data(), result.size());
+		if (!closed) tilesRendered++;
+	}
+
+	// the coordinator went away before the frame was done
+	return false;
+}
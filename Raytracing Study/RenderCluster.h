@@ -0,0 +1,77 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Framebuffer.h"
+#include "Raytracer.h"
+#include "Socket.h"
+
+// Splits one frame into tiles rendered by worker processes on this or other machines. Workers
+// connect to the coordinator, which sends each of them the job once, hands out tiles as earlier
+// ones come back and copies the returned pixels into the frame. Both ends must share byte order.
+//
+// A job is opaque here: the caller encodes whatever the workers need to set up the same
+// Raytracer (settings and a packed scene, say), and RenderWorker's setup decodes it.
+class RenderCoordinator
+{
+public:
+	int tileSize = 64;
+
+	// Tiles queued on each worker, so it starts the next one without waiting for a round trip.
+	int tilesInFlight = 2;
+
+	// Once no tile is left to hand out, a tile outstanding this many times as long as tiles take
+	// on average is also sent to an idle worker, and the first copy back is kept.
+	double stragglerFactor = 3;
+
+	// A worker with tiles outstanding that sends nothing for this long is dropped and its tiles
+	// handed to others; so is one whose connection fails.
+	double workerTimeout = 30;
+
+	// Render gives up when no worker is connected for this long.
+	double waitTimeout = 60;
+
+	struct WorkerReport
+	{
+		int tiles = 0;    // tiles whose result was kept
+		double busy = 0;  // seconds from the first tile sent to the last result
+		bool lost = false;
+	};
+
+	struct Report
+	{
+		int tiles = 0;
+		int redispatched = 0; // tiles sent again after a worker was lost or fell behind
+		int duplicates = 0;   // results discarded because another copy came back first
+		double seconds = 0;
+		TraceStats stats;
+		std::vector<WorkerReport> workers;
+	};
+	Report lastReport;
+
+	bool Listen(const std::string& address);
+
+	// Renders frame from the tiles workers send back. Workers that connect while it runs join in.
+	// Returns false if the frame could not be finished.
+	bool Render(const std::string& job, MemoryFramebuffer& frame);
+
+private:
+	Socket listener;
+};
+
+class RenderWorker
+{
+public:
+	// Seconds Run keeps retrying while the coordinator is not listening yet.
+	double connectTimeout = 10;
+
+	// Seconds slept before each tile, to watch the coordinator work around a slow worker.
+	double tileDelay = 0;
+
+	int tilesRendered = 0;
+
+	// Connects to the coordinator at address and renders the tiles it sends until the frame is
+	// done. setup turns the job into a Raytracer of the frame's size, or nullptr to refuse it.
+	bool Run(const std::string& address, const std::function<std::unique_ptr<Raytracer>(const std::string& job)>& setup);
+};
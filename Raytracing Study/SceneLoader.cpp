@@ -0,0 +1,684 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include "SceneLoader.h"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include "MappedFile.h"
+
+namespace
+{
+	// Layout of a .cache file: magic, version, the scene hash, the scene BVH, then one block per
+	// mesh or sphere set in the order the scene creates them. Vectors are a uint64 count
+	// followed by the elements.
+	const char cacheMagic[4] = { 'R', 'T', 'S', 'C' };
+	const uint32_t cacheVersion = 1;
+
+	enum CacheBlock : uint32_t
+	{
+		MeshBlock = 1,
+		SphereSetBlock = 2,
+	};
+
+	uint64_t Fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// 0 for a file that cannot be read.
+	uint64_t HashFile(const std::string& filename)
+	{
+		MappedFile file;
+		return file.Open(filename) ? Fnv1a(file.Data(), file.Size()) : 0;
+	}
+
+	bool ReadFile(const std::string& filename, std::string& contents)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		if (!file) return false;
+
+		std::ostringstream buffer;
+		buffer << file.rdbuf();
+		contents = buffer.str();
+		return true;
+	}
+
+	// Whether every node and index of bvh stays inside its arrays and refers to one of primCount
+	// prims, with children after their parent as BVH::Refit expects.
+	bool IsValid(const BVH& bvh, size_t primCount)
+	{
+		if (bvh.indices.size() != primCount) return false;
+
+		for (size_t i = 0; i < bvh.nodes.size(); i++)
+		{
+			const BVH::Node& node = bvh.nodes[i];
+			if (node.count < 0 || node.left < 0) return false;
+			if (node.count > 0 && size_t(node.left) + node.count > bvh.indices.size()) return false;
+			if (node.count == 0 && (size_t(node.left) + 1 >= bvh.nodes.size() || size_t(node.left) <= i)) return false;
+		}
+
+		for (int i : bvh.indices)
+		{
+			if (i < 0 || size_t(i) >= primCount) return false;
+		}
+
+		return true;
+	}
+
+	class CacheWriter
+	{
+	public:
+		std::ostream& out;
+
+		CacheWriter(std::ostream& out) : out(out)
+		{
+		}
+
+		template<typename T>
+		void Write(const T& value)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "cache entries are written as raw bytes");
+			out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+
+		template<typename T>
+		void Write(const std::vector<T>& values)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "cache entries are written as raw bytes");
+			Write(uint64_t(values.size()));
+			out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+		}
+
+		void Write(const BVH& bvh)
+		{
+			Write(bvh.nodes);
+			Write(bvh.indices);
+		}
+	};
+
+	// Reads a cache from a mapped file or from bytes held elsewhere.
+	class CacheReader
+	{
+	public:
+		MappedFile file;
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		size_t offset = 0;
+
+		bool Open(const std::string& filename)
+		{
+			if (!file.Open(filename)) return false;
+
+			Attach(file.Data(), file.Size());
+			return true;
+		}
+
+		void Attach(const uint8_t* bytes, size_t count)
+		{
+			data = bytes;
+			size = count;
+			offset = 0;
+		}
+
+		template<typename T>
+		bool Read(T& value)
+		{
+			if (size - offset < sizeof(T)) return false;
+
+			memcpy(&value, data + offset, sizeof(T));
+			offset += sizeof(T);
+			return true;
+		}
+
+		template<typename T>
+		bool Read(std::vector<T>& values)
+		{
+			uint64_t count;
+			if (!Read(count) || count > (size - offset) / sizeof(T)) return false;
+
+			values.resize(size_t(count));
+			memcpy(values.data(), data + offset, size_t(count) * sizeof(T));
+			offset += size_t(count) * sizeof(T);
+			return true;
+		}
+
+		// Whether the cache starts with the header of this format and version, keyed by hash.
+		bool ReadHeader(uint64_t hash)
+		{
+			char magic[4];
+			uint32_t version;
+			uint64_t key;
+			return Read(magic) && memcmp(magic, cacheMagic, sizeof(magic)) == 0
+				&& Read(version) && version == cacheVersion
+				&& Read(key) && key == hash;
+		}
+
+		bool Read(BVH& bvh)
+		{
+			return Read(bvh.nodes) && Read(bvh.indices);
+		}
+	};
+
+	bool ReadVec3(std::istream& in, vec3& v)
+	{
+		return bool(in >> v.x >> v.y >> v.z);
+	}
+
+	bool ReadVec2(std::istream& in, vec2& v)
+	{
+		return bool(in >> v.x >> v.y);
+	}
+
+	bool ReadCachedMesh(CacheReader& cache, TriangleMesh& mesh)
+	{
+		uint32_t block;
+		if (!cache.Read(block) || block != MeshBlock) return false;
+		if (!cache.Read(mesh.positions) || !cache.Read(mesh.uvs) || !cache.Read(mesh.indices) || !cache.Read(mesh.bvh)) return false;
+
+		if (!mesh.uvs.empty() && mesh.uvs.size() != mesh.positions.size()) return false;
+		for (uint32_t i : mesh.indices)
+		{
+			if (i >= mesh.positions.size()) return false;
+		}
+
+		if (mesh.indices.size() % 3 != 0 || !IsValid(mesh.bvh, mesh.indices.size() / 3)) return false;
+
+		mesh.BuildRecords();
+		return true;
+	}
+
+	bool ReadCachedSphereSet(CacheReader& cache, SphereSet& set)
+	{
+		uint32_t block;
+		int32_t count;
+		if (!cache.Read(block) || block != SphereSetBlock || !cache.Read(count) || count < 0) return false;
+		if (!cache.Read(set.cx) || !cache.Read(set.cy) || !cache.Read(set.cz) || !cache.Read(set.radii)) return false;
+		if (!cache.Read(set.ids) || !cache.Read(set.bvh)) return false;
+
+		set.count = count;
+
+		const size_t stored = size_t(count) + SphereSet::padding;
+		if (set.cx.size() != stored || set.cy.size() != stored || set.cz.size() != stored || set.radii.size() != stored) return false;
+		return set.ids.size() == size_t(count) && IsValid(set.bvh, size_t(count));
+	}
+
+	void WriteMesh(CacheWriter& cache, const TriangleMesh& mesh)
+	{
+		cache.Write(uint32_t(MeshBlock));
+		cache.Write(mesh.positions);
+		cache.Write(mesh.uvs);
+		cache.Write(mesh.indices);
+		cache.Write(mesh.bvh);
+	}
+
+	void WriteCache(std::ostream& out, uint64_t hash, const BVH& bvh, const std::vector<std::shared_ptr<Object>>& shapes)
+	{
+		CacheWriter cache(out);
+		cache.out.write(cacheMagic, sizeof(cacheMagic));
+		cache.Write(cacheVersion);
+		cache.Write(hash);
+		cache.Write(bvh);
+
+		for (auto& object : shapes)
+		{
+			if (auto mesh = dynamic_cast<TriangleMesh*>(object.get()))
+			{
+				WriteMesh(cache, *mesh);
+			}
+			else if (auto set = dynamic_cast<SphereSet*>(object.get()))
+			{
+				cache.Write(uint32_t(SphereSetBlock));
+				cache.Write(int32_t(set->count));
+				cache.Write(set->cx);
+				cache.Write(set->cy);
+				cache.Write(set->cz);
+				cache.Write(set->radii);
+				cache.Write(set->ids);
+				cache.Write(set->bvh);
+			}
+		}
+	}
+
+	void WriteCache(const std::string& filename, uint64_t hash, const BVH& bvh, const std::vector<std::shared_ptr<Object>>& shapes)
+	{
+		std::ofstream out(filename, std::ios::binary);
+		if (!out) return;
+
+		WriteCache(out, hash, bvh, shapes);
+		if (!out) std::cout << "Failed to write scene cache " << filename << std::endl;
+	}
+
+	void WriteString(std::ostream& out, const std::string& value)
+	{
+		const uint64_t size = value.size();
+		out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		out.write(value.data(), value.size());
+	}
+
+	bool ReadString(CacheReader& in, std::string& value)
+	{
+		uint64_t size;
+		if (!in.Read(size) || size > in.size - in.offset) return false;
+
+		value.assign(reinterpret_cast<const char*>(in.data + in.offset), size_t(size));
+		in.offset += size_t(size);
+		return true;
+	}
+}
+
+std::string SceneLoader::Resolve(const std::string& path) const
+{
+	const bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	return absolute ? path : directory + path;
+}
+
+std::shared_ptr<Texture> SceneLoader::LoadTexture(const std::string& path)
+{
+	auto& texture = textures[Resolve(path)];
+	if (!texture) texture = Texture::Open(Resolve(path));
+	return texture;
+}
+
+bool SceneLoader::Load(const std::string& filename, Raytracer& raytracer)
+{
+	std::string text;
+	if (!ReadFile(filename, text))
+	{
+		std::cout << "Failed to load scene " << filename << std::endl;
+		return false;
+	}
+
+	this->filename = filename;
+	this->text = text;
+
+	const size_t slash = filename.find_last_of("/\\");
+	directory = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+
+	// the key covers the scene text and the contents of every mesh it loads
+	hash = Fnv1a(&cacheVersion, sizeof(cacheVersion));
+	hash = Fnv1a(text.data(), text.size(), hash);
+	for (auto& line : Lines(text))
+	{
+		std::istringstream in(line);
+		std::string keyword, name, material, path, contents;
+		if (!(in >> keyword) || (keyword == "define" && !(in >> name >> keyword))) continue;
+		if (keyword != "mesh" || !(in >> material >> path)) continue;
+
+		if (ReadFile(Resolve(path), contents)) hash = Fnv1a(contents.data(), contents.size(), hash);
+	}
+
+	const std::string cacheName = filename + ".cache";
+
+	MappedFile cache;
+	if (useCache) cache.Open(cacheName);
+
+	Build(cache.Data(), cache.Size(), raytracer);
+	if (useCache && !cacheHit) WriteCache(cacheName, hash, raytracer.bvh, shapes);
+
+	return true;
+}
+
+// Packed layout: the path, the text and the cache, each a uint64 size followed by its bytes, then
+// the added meshes as a uint64 count and cache mesh blocks, then a uint64 count of textures, each
+// its resolved path and the hash of its source file.
+std::string SceneLoader::Pack(const Raytracer& raytracer, const std::vector<std::shared_ptr<TriangleMesh>>& meshes) const
+{
+	std::ostringstream cache(std::ios::binary);
+	WriteCache(cache, hash, raytracer.bvh, shapes);
+
+	std::ostringstream out(std::ios::binary);
+	CacheWriter packed(out);
+	WriteString(out, filename);
+	WriteString(out, text);
+	WriteString(out, cache.str());
+
+	packed.Write(uint64_t(meshes.size()));
+	for (auto& mesh : meshes) WriteMesh(packed, *mesh);
+
+	packed.Write(uint64_t(textures.size()));
+	for (auto& texture : textures)
+	{
+		WriteString(out, texture.first);
+		packed.Write(HashFile(texture.second->source));
+	}
+
+	return out.str();
+}
+
+bool SceneLoader::Unpack(const std::string& packed, Raytracer& raytracer, std::vector<std::shared_ptr<TriangleMesh>>* meshes)
+{
+	CacheReader in;
+	in.Attach(reinterpret_cast<const uint8_t*>(packed.data()), packed.size());
+
+	std::string cache;
+	uint32_t version;
+	if (!ReadString(in, filename) || !ReadString(in, text) || !ReadString(in, cache)) return false;
+	if (cache.size() < sizeof(cacheMagic) + sizeof(version) + sizeof(hash)) return false;
+
+	std::vector<std::shared_ptr<TriangleMesh>> added;
+	uint64_t count;
+	if (!in.Read(count)) return false;
+	for (uint64_t i = 0; i < count; i++)
+	{
+		auto mesh = std::make_shared<TriangleMesh>();
+		if (!ReadCachedMesh(in, *mesh)) return false;
+		added.push_back(mesh);
+	}
+
+	std::map<std::string, uint64_t> textureHashes;
+	if (!in.Read(count)) return false;
+	for (uint64_t i = 0; i < count; i++)
+	{
+		std::string path;
+		uint64_t fileHash;
+		if (!ReadString(in, path) || !in.Read(fileHash)) return false;
+		textureHashes[path] = fileHash;
+	}
+
+	// the packing process computed the key, from meshes this one may not be able to read
+	memcpy(&hash, cache.data() + sizeof(cacheMagic) + sizeof(version), sizeof(hash));
+
+	const size_t slash = filename.find_last_of("/\\");
+	directory = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+
+	Build(reinterpret_cast<const uint8_t*>(cache.data()), cache.size(), raytracer);
+
+	for (auto& texture : textures)
+	{
+		auto packedHash = textureHashes.find(texture.first);
+		if (packedHash == textureHashes.end() || packedHash->second != HashFile(texture.second->source))
+		{
+			std::cout << "Texture " << texture.first << " differs from the one the scene was packed with" << std::endl;
+			return false;
+		}
+	}
+
+	if (meshes) *meshes = added;
+	return true;
+}
+
+std::vector<std::string> SceneLoader::Lines(const std::string& text)
+{
+	std::vector<std::string> lines;
+	std::istringstream stream(text);
+	for (std::string line; std::getline(stream, line);)
+	{
+		const size_t comment = line.find('#');
+		lines.push_back(comment == std::string::npos ? line : line.substr(0, comment));
+	}
+	return lines;
+}
+
+void SceneLoader::Build(const uint8_t* cacheData, size_t cacheSize, Raytracer& raytracer)
+{
+	cacheHit = false;
+	textures.clear();
+
+	const std::vector<std::string> lines = Lines(text);
+
+	CacheReader cache;
+	cache.Attach(cacheData, cacheData ? cacheSize : 0);
+
+	BVH cachedBVH;
+	bool cached = cache.ReadHeader(hash) && cache.Read(cachedBVH);
+
+	std::map<std::string, Material> materials;
+	std::map<std::string, std::shared_ptr<Object>> geometries;
+	std::vector<std::shared_ptr<Object>> objects;
+	shapes.clear();
+	EnvironmentMap environment;
+	Camera camera = raytracer.camera;
+	vec3 lightPos = raytracer.light.pos;
+
+	for (size_t l = 0; l < lines.size(); l++)
+	{
+		std::istringstream in(lines[l]);
+		std::string keyword;
+		if (!(in >> keyword)) continue;
+
+		auto fail = [&](const std::string& message) {
+			std::cout << filename << ":" << l + 1 << ": " << message << std::endl;
+		};
+
+		if (keyword == "camera")
+		{
+			std::string lookat;
+			vec3 target;
+			if (!ReadVec3(in, camera.position)) fail("expected camera <x y z>");
+			else if (in >> lookat && (lookat != "lookat" || !ReadVec3(in, target))) fail("expected camera <x y z> [lookat <x y z>]");
+			else if (lookat == "lookat") camera.LookAt(target);
+			continue;
+		}
+
+		if (keyword == "light")
+		{
+			if (!ReadVec3(in, lightPos)) fail("expected light <x y z>");
+			continue;
+		}
+
+		if (keyword == "environment")
+		{
+			std::string paths[6];
+			if (!(in >> paths[0] >> paths[1] >> paths[2] >> paths[3] >> paths[4] >> paths[5]))
+			{
+				fail("expected six environment faces");
+				continue;
+			}
+
+			for (int f = 0; f < 6; f++) environment.faces[f] = LoadTexture(paths[f]);
+			continue;
+		}
+
+		if (keyword == "material")
+		{
+			std::string name, key;
+			if (!(in >> name))
+			{
+				fail("expected a material name");
+				continue;
+			}
+
+			Material material(vec3(0));
+			bool valid = true;
+			while (valid && in >> key)
+			{
+				std::string path;
+
+				if (key == "amb") valid = ReadVec3(in, material.amb);
+				else if (key == "diff") valid = ReadVec3(in, material.diff);
+				else if (key == "spec") valid = ReadVec3(in, material.spec);
+				else if (key == "alpha") valid = bool(in >> material.alpha);
+				else if (key == "reflection") valid = bool(in >> material.reflection);
+				else if (key == "transparency") valid = bool(in >> material.transparency);
+				else if (key == "texture" && (valid = bool(in >> path))) material.ambTexture = material.diffTexture = LoadTexture(path);
+				else if (key == "ambTexture" && (valid = bool(in >> path))) material.ambTexture = LoadTexture(path);
+				else if (key == "diffTexture" && (valid = bool(in >> path))) material.diffTexture = LoadTexture(path);
+				else valid = false;
+			}
+
+			if (!valid) fail("bad material property " + key);
+			else materials[name] = material;
+			continue;
+		}
+
+		if (keyword == "instance")
+		{
+			std::string name, key, materialName;
+			if (!(in >> name))
+			{
+				fail("expected instance <name> [material <material>] [translate <x y z>] [rotate <degrees> <x y z>] [scale <x y z>]...");
+				continue;
+			}
+
+			auto geometry = geometries.find(name);
+			if (geometry == geometries.end())
+			{
+				fail("unknown geometry " + name);
+				continue;
+			}
+
+			auto instance = std::make_shared<Instance>(geometry->second);
+			mat4 transform(1);
+			bool valid = true;
+			while (valid && in >> key)
+			{
+				vec3 v;
+				float degrees;
+
+				if (key == "material" && (valid = in >> materialName && materials.count(materialName) > 0))
+				{
+					instance->material = materials[materialName];
+					instance->overrideMaterial = true;
+				}
+				else if (key == "translate" && (valid = ReadVec3(in, v))) transform = glm::translate(mat4(1), v) * transform;
+				else if (key == "rotate" && (valid = in >> degrees && ReadVec3(in, v))) transform = glm::rotate(mat4(1), glm::radians(degrees), v) * transform;
+				else if (key == "scale" && (valid = ReadVec3(in, v))) transform = glm::scale(mat4(1), v) * transform;
+				else valid = false;
+			}
+
+			// also catches the NaNs of a rotation about a zero axis
+			if (!valid) fail(key == "material" && !materialName.empty() ? "unknown material " + materialName : "bad instance property " + key);
+			else if (!(glm::abs(glm::determinant(transform)) > 0)) fail("instance transform is singular");
+			else
+			{
+				instance->SetTransform(transform);
+				objects.push_back(instance);
+			}
+			continue;
+		}
+
+		const bool define = keyword == "define";
+		std::string name;
+		if (define && !(in >> name >> keyword))
+		{
+			fail("expected define <name> <sphere, spheres, triangle, square or mesh statement>");
+			continue;
+		}
+
+		std::string materialName;
+		if (!(in >> materialName))
+		{
+			fail("unknown statement " + keyword);
+			continue;
+		}
+
+		auto material = materials.find(materialName);
+		if (material == materials.end())
+		{
+			fail("unknown material " + materialName);
+			continue;
+		}
+
+		std::shared_ptr<Object> object;
+
+		if (keyword == "sphere")
+		{
+			vec3 center;
+			float radius;
+			if (ReadVec3(in, center) && in >> radius) object = std::make_shared<Sphere>(center, radius);
+			else fail("expected sphere <material> <x y z> <radius>");
+		}
+		else if (keyword == "spheres")
+		{
+			std::vector<vec3> centers;
+			std::vector<float> radii;
+
+			vec3 center;
+			float radius;
+			while (ReadVec3(in, center) && in >> radius)
+			{
+				centers.push_back(center);
+				radii.push_back(radius);
+			}
+
+			if (centers.empty() || !in.eof())
+			{
+				fail("expected spheres <material> <x y z radius>...");
+			}
+			else
+			{
+				auto set = std::make_shared<SphereSet>();
+				if (!cached || !ReadCachedSphereSet(cache, *set) || set->count != int(centers.size()))
+				{
+					cached = false;
+					set = std::make_shared<SphereSet>(centers, radii);
+				}
+				object = set;
+			}
+		}
+		else if (keyword == "triangle")
+		{
+			vec3 v[3];
+			if (ReadVec3(in, v[0]) && ReadVec3(in, v[1]) && ReadVec3(in, v[2])) object = std::make_shared<Triangle>(v[0], v[1], v[2]);
+			else fail("expected triangle <material> <v0> <v1> <v2>");
+		}
+		else if (keyword == "square")
+		{
+			vec3 v[4];
+			vec2 uv[4];
+			if (!ReadVec3(in, v[0]) || !ReadVec3(in, v[1]) || !ReadVec3(in, v[2]) || !ReadVec3(in, v[3]))
+			{
+				fail("expected square <material> <v0> <v1> <v2> <v3> [uv0 uv1 uv2 uv3]");
+			}
+			else if (!ReadVec2(in, uv[0])) object = std::make_shared<Square>(v[0], v[1], v[2], v[3]);
+			else if (ReadVec2(in, uv[1]) && ReadVec2(in, uv[2]) && ReadVec2(in, uv[3])) object = std::make_shared<Square>(v[0], v[1], v[2], v[3], uv[0], uv[1], uv[2], uv[3]);
+			else fail("expected four square uvs");
+		}
+		else if (keyword == "mesh")
+		{
+			std::string path, fit;
+			vec3 center;
+			float size = 0;
+
+			if (!(in >> path) || (in >> fit && (fit != "fit" || !ReadVec3(in, center) || !(in >> size))))
+			{
+				fail("expected mesh <material> <file.obj> [fit <x y z> <size>]");
+				continue;
+			}
+
+			auto mesh = std::make_shared<TriangleMesh>();
+			if (!cached || !ReadCachedMesh(cache, *mesh))
+			{
+				cached = false;
+				mesh = TriangleMesh::LoadObj(Resolve(path));
+				if (mesh && size > 0) mesh->Fit(center, size);
+			}
+			object = mesh;
+		}
+		else
+		{
+			fail("unknown statement " + keyword);
+		}
+
+		if (!object) continue;
+
+		object->material = material->second;
+		shapes.push_back(object);
+
+		if (define) geometries[name] = object;
+		else objects.push_back(object);
+	}
+
+	raytracer.objects = objects;
+	raytracer.environment = environment;
+	raytracer.camera = camera;
+	raytracer.light.pos = lightPos;
+
+	if (cached && IsValid(cachedBVH, objects.size()))
+	{
+		cacheHit = true;
+		raytracer.bvh = cachedBVH;
+		raytracer.BuildScene(false);
+	}
+	else
+	{
+		raytracer.BuildScene();
+	}
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "Raytracer.h"
+
+// Reads a text scene into a Raytracer, replacing its objects, environment, light and camera.
+// One statement per line, # starts a comment, paths are relative to the scene file:
+//
+//   camera <x y z> [lookat <x y z>]                eye position and the point it faces
+//   light <x y z>
+//   environment <posx> <negx> <posy> <negy> <posz> <negz>
+//   material <name> [amb r g b] [diff r g b] [spec r g b] [alpha a] [reflection r]
+//                   [transparency t] [texture file] [ambTexture file] [diffTexture file]
+//   sphere <material> <x y z> <radius>
+//   spheres <material> <x y z radius>...          one SphereSet
+//   triangle <material> <v0> <v1> <v2>
+//   square <material> <v0> <v1> <v2> <v3> [uv0 uv1 uv2 uv3]
+//   mesh <material> <file.obj> [fit <x y z> <size>]
+//   define <name> <sphere, spheres, triangle, square or mesh statement>
+//   instance <name> [material <material>] [translate <x y z>] [rotate <degrees> <x y z>]
+//            [scale <x y z>]...
+//
+// A define statement builds its geometry without adding it to the scene; each instance of it
+// adds the geometry through the transforms in the order given, with the defined material unless
+// another is named, and shares its buffers and BVH with the other instances.
+//
+// Materials and definitions must come before they are used; unset colors are black. The BVHs of
+// the scene, its meshes and sphere sets, and the mesh vertex buffers are cached in <scene>.cache,
+// keyed by a hash of the scene text and every OBJ it loads.
+class SceneLoader
+{
+public:
+	bool useCache = true;
+
+	// Filled in by Load.
+	bool cacheHit = false;
+	uint64_t hash = 0;
+
+	bool Load(const std::string& filename, Raytracer& raytracer);
+
+	// The loaded scene as one blob of its path, text and cache, plus the buffers of meshes added
+	// outside the scene text and a hash of every texture file it read. Unpack loads it in another
+	// process without parsing meshes or building BVHs and hands those meshes back in order.
+	// Textures are read from their paths there, and Unpack fails if one differs from the file
+	// packed. Call before raytracer's objects change.
+	std::string Pack(const Raytracer& raytracer, const std::vector<std::shared_ptr<TriangleMesh>>& meshes = {}) const;
+	bool Unpack(const std::string& packed, Raytracer& raytracer, std::vector<std::shared_ptr<TriangleMesh>>* meshes = nullptr);
+
+private:
+	std::string filename;
+	std::string text;
+	std::string directory;
+	std::map<std::string, std::shared_ptr<Texture>> textures;
+
+	// Every object the scene statements and definitions created, in order; the cache holds the
+	// meshes and sphere sets among them.
+	std::vector<std::shared_ptr<Object>> shapes;
+
+	static std::vector<std::string> Lines(const std::string& text);
+
+	// Creates the scene from text, taking meshes, sphere sets and the BVH from the cache bytes
+	// where they are valid for hash.
+	void Build(const uint8_t* cacheData, size_t cacheSize, Raytracer& raytracer);
+
+	std::string Resolve(const std::string& path) const;
+	std::shared_ptr<Texture> LoadTexture(const std::string& path);
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RAYTRACER_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RAYTRACER_SIMD 0
+#endif
+
+// GCC and Clang only emit AVX2 inside functions compiled for it, so the 8-wide code is wrapped in a
+// target region. MSVC accepts the intrinsics anywhere and the dispatcher guards their use at runtime.
+#if RAYTRACER_SIMD && defined(__clang__)
+#define SIMD_BEGIN_AVX2 _Pragma("clang attribute push(__attribute__((target(\"avx2\"))), apply_to = function)")
+#define SIMD_END_AVX2 _Pragma("clang attribute pop")
+#elif RAYTRACER_SIMD && defined(__GNUC__)
+#define SIMD_BEGIN_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2\")")
+#define SIMD_END_AVX2 _Pragma("GCC pop_options")
+#else
+#define SIMD_BEGIN_AVX2
+#define SIMD_END_AVX2
+#endif
+
+// The value is the packet width.
+enum class SimdLevel
+{
+	Scalar = 1,
+	SSE = 4,
+	AVX2 = 8,
+};
+
+inline const char* SimdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SimdLevel::AVX2: return "avx2";
+	case SimdLevel::SSE: return "sse";
+	default: return "scalar";
+	}
+}
+
+inline SimdLevel DetectSimd()
+{
+#if RAYTRACER_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] >= 7)
+	{
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+
+		__cpuidex(info, 7, 0);
+		const bool avx2 = (info[1] & (1 << 5)) != 0;
+
+		if (osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6) return SimdLevel::AVX2;
+	}
+	return SimdLevel::SSE;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE;
+#endif
+#else
+	return SimdLevel::Scalar;
+#endif
+}
+
+#if RAYTRACER_SIMD
+struct Float4
+{
+	static const int width = 4;
+	__m128 v;
+
+	Float4()
+	{
+	}
+
+	Float4(__m128 v) : v(v)
+	{
+	}
+
+	static Float4 Set(float x) { return _mm_set1_ps(x); }
+	static Float4 Load(const float* p) { return _mm_load_ps(p); }
+	static Float4 LoadUnaligned(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_store_ps(p, v); }
+	int Mask() const { return _mm_movemask_ps(v); }
+
+	static Float4 Min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+	static Float4 Max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+	static Float4 Sqrt(Float4 a) { return _mm_sqrt_ps(a.v); }
+	static Float4 Abs(Float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+	static Float4 Select(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+};
+
+inline Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 operator-(Float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+inline Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+inline Float4 operator<(Float4 a, Float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+
+SIMD_BEGIN_AVX2
+struct Float8
+{
+	static const int width = 8;
+	__m256 v;
+
+	Float8()
+	{
+	}
+
+	Float8(__m256 v) : v(v)
+	{
+	}
+
+	static Float8 Set(float x) { return _mm256_set1_ps(x); }
+	static Float8 Load(const float* p) { return _mm256_load_ps(p); }
+	static Float8 LoadUnaligned(const float* p) { return _mm256_loadu_ps(p); }
+	void Store(float* p) const { _mm256_store_ps(p, v); }
+	int Mask() const { return _mm256_movemask_ps(v); }
+
+	static Float8 Min(Float8 a, Float8 b) { return _mm256_min_ps(a.v, b.v); }
+	static Float8 Max(Float8 a, Float8 b) { return _mm256_max_ps(a.v, b.v); }
+	static Float8 Sqrt(Float8 a) { return _mm256_sqrt_ps(a.v); }
+	static Float8 Abs(Float8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+	static Float8 Select(Float8 mask, Float8 a, Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+};
+
+inline Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.v, b.v); }
+inline Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.v, b.v); }
+inline Float8 operator-(Float8 a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline Float8 operator&(Float8 a, Float8 b) { return _mm256_and_ps(a.v, b.v); }
+inline Float8 operator|(Float8 a, Float8 b) { return _mm256_or_ps(a.v, b.v); }
+inline Float8 operator<(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Float8 operator<=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Float8 operator>(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Float8 operator>=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+SIMD_END_AVX2
+#endif
\ No newline at end of file
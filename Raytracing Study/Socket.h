@@ -0,0 +1,199 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Blocking stream socket over TCP ("host:port", ":port" to listen on every interface) or a Unix
+// domain socket ("unix:/path"). POSIX only, like the headless targets that use it.
+class Socket
+{
+public:
+	Socket() = default;
+
+	explicit Socket(int fd) : fd(fd)
+	{
+	}
+
+	Socket(Socket&& other) noexcept : fd(other.fd)
+	{
+		other.fd = -1;
+	}
+
+	Socket& operator=(Socket&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Close();
+			fd = other.fd;
+			other.fd = -1;
+		}
+		return *this;
+	}
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+
+	~Socket()
+	{
+		Close();
+	}
+
+	bool Listen(const std::string& address)
+	{
+		return Open(address, true);
+	}
+
+	bool Connect(const std::string& address)
+	{
+		return Open(address, false);
+	}
+
+	// Invalid if no connection could be taken.
+	Socket Accept()
+	{
+		Socket connection(accept(fd, nullptr, nullptr));
+
+		// fails harmlessly on Unix domain sockets
+		const int on = 1;
+		if (connection.Valid()) setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		return connection;
+	}
+
+	bool Send(const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			const ssize_t sent = send(fd, bytes, size, noSignal);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0) return false;
+
+			bytes += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	// False if the peer closed the connection, or nothing arrived within the receive timeout.
+	bool Receive(void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+			const ssize_t received = recv(fd, bytes, size, 0);
+			if (received < 0 && errno == EINTR) continue;
+			if (received <= 0) return false;
+
+			bytes += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+	void SetReceiveTimeout(double seconds)
+	{
+		timeval timeout;
+		timeout.tv_sec = long(seconds);
+		timeout.tv_usec = long((seconds - double(timeout.tv_sec)) * 1e6);
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	}
+
+	bool Valid() const
+	{
+		return fd >= 0;
+	}
+
+	int Handle() const
+	{
+		return fd;
+	}
+
+	void Close()
+	{
+		if (fd < 0) return;
+
+		close(fd);
+		fd = -1;
+	}
+
+private:
+	int fd = -1;
+
+#ifdef MSG_NOSIGNAL
+	static const int noSignal = MSG_NOSIGNAL;
+#else
+	static const int noSignal = 0;
+#endif
+
+	bool Open(const std::string& address, bool listening)
+	{
+		Close();
+
+		if (address.compare(0, 5, "unix:") == 0)
+		{
+			sockaddr_un local = {};
+			local.sun_family = AF_UNIX;
+
+			const std::string path = address.substr(5);
+			if (path.empty() || path.size() >= sizeof(local.sun_path)) return false;
+			memcpy(local.sun_path, path.c_str(), path.size() + 1);
+
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0) return false;
+
+			// a socket file left by an earlier coordinator would make bind fail
+			if (listening) unlink(path.c_str());
+
+			const sockaddr* name = reinterpret_cast<const sockaddr*>(&local);
+			if (listening ? bind(fd, name, sizeof(local)) != 0 || listen(fd, SOMAXCONN) != 0 : connect(fd, name, sizeof(local)) != 0)
+			{
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		const size_t colon = address.find_last_of(':');
+		if (colon == std::string::npos) return false;
+
+		const std::string host = address.substr(0, colon);
+		const std::string port = address.substr(colon + 1);
+
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = listening ? AI_PASSIVE : 0;
+
+		addrinfo* found = nullptr;
+		if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0) return false;
+
+		for (addrinfo* info = found; info && fd < 0; info = info->ai_next)
+		{
+			fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+			if (fd < 0) continue;
+
+			const int on = 1;
+			if (listening) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			// tile requests are small and answered at once
+			else setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+			if (listening ? bind(fd, info->ai_addr, info->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0 : connect(fd, info->ai_addr, info->ai_addrlen) != 0)
+			{
+				Close();
+			}
+		}
+
+		freeaddrinfo(found);
+		return fd >= 0;
+	}
+};
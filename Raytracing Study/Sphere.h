@@ -15,6 +15,7 @@ public:
 	Hit CheckRayCollision(Ray& ray)
 	{
 		Hit hit = Hit{ -1, vec3(0), vec3(0) };
+		TRACE_STAT(threadStats.intersectionTests++);
 
 		const float b = glm::dot(ray.dir, ray.start - center);
 		const float c = glm::dot(ray.start - center, ray.start - center) - radius * radius; 
@@ -30,8 +31,24 @@ public:
 
 			hit.point = ray.start + hit.d * ray.dir;
 			hit.normal = glm::normalize(hit.point - center);
+			hit.curvature = 1 / radius;
 		}
 
 		return hit;
 	}
+
+	AABB GetBounds()
+	{
+		return AABB(center - vec3(radius), center + vec3(radius));
+	}
+
+	bool Convex() const
+	{
+		return true;
+	}
+
+	void Translate(const vec3& offset)
+	{
+		center += offset;
+	}
 };
\ No newline at end of file
@@ -0,0 +1,179 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "Object.h"
+#include "BVH.h"
+#include "RayPacket.h"
+
+// Many spheres sharing one material, kept as separate x/y/z/radius arrays so one ray is tested
+// against a whole SIMD register of spheres at a time. A small BVH groups the spheres into
+// contiguous runs of up to 16 so large sets are not scanned linearly.
+class SphereSet : public Object
+{
+public:
+	static const int padding = 16;
+
+	std::vector<float> cx, cy, cz, radii;
+	std::vector<int> ids;
+	int count = 0;
+
+	BVH bvh;
+	SimdLevel simdLevel = DetectSimd();
+
+	SphereSet(vec3 color = vec3(1)) : Object(color)
+	{
+		bvh.intersectionCost = 1.0f / 8;
+		bvh.maxLeafSize = 16;
+	}
+
+	SphereSet(const std::vector<vec3>& centers, const std::vector<float>& radii, vec3 color = vec3(1)) : SphereSet(color)
+	{
+		count = int(centers.size());
+		for (int i = 0; i < count; i++)
+		{
+			cx.push_back(centers[i].x);
+			cy.push_back(centers[i].y);
+			cz.push_back(centers[i].z);
+			this->radii.push_back(radii[i]);
+		}
+
+		Build();
+	}
+
+	vec3 Center(int i) const
+	{
+		return vec3(cx[i], cy[i], cz[i]);
+	}
+
+	AABB SphereBounds(int i) const
+	{
+		return AABB(Center(i) - vec3(radii[i]), Center(i) + vec3(radii[i]));
+	}
+
+	// Reorders the arrays so every BVH leaf is a contiguous run of spheres.
+	void Build()
+	{
+		std::vector<AABB> bounds(count);
+		for (int i = 0; i < count; i++) bounds[i] = SphereBounds(i);
+
+		bvh.Build(bounds);
+
+		ids = bvh.indices;
+		Reorder(cx);
+		Reorder(cy);
+		Reorder(cz);
+		Reorder(radii);
+
+		// the kernels read whole registers past the end of a run
+		cx.resize(count + padding, 0);
+		cy.resize(count + padding, 0);
+		cz.resize(count + padding, 0);
+		radii.resize(count + padding, 0);
+	}
+
+	// Index (in the order the spheres were added) of the nearest sphere hit closer than t, or -1.
+	int FindNearest(Ray& ray, float& t)
+	{
+		const int nearest = FindStored(ray, t);
+		return nearest >= 0 ? ids[nearest] : -1;
+	}
+
+	Hit CheckRayCollision(Ray& ray)
+	{
+		Hit hit = Hit{ -1, vec3(0), vec3(0) };
+
+		float t = FLT_MAX;
+		const int nearest = FindStored(ray, t);
+
+		if (nearest >= 0)
+		{
+			hit.d = t;
+			hit.point = ray.start + hit.d * ray.dir;
+			hit.normal = glm::normalize(hit.point - Center(nearest));
+			hit.curvature = 1 / radii[nearest];
+		}
+
+		return hit;
+	}
+
+	AABB GetBounds()
+	{
+		return bvh.IsEmpty() ? AABB() : bvh.nodes[0].bounds;
+	}
+
+	void Translate(const vec3& offset)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			cx[i] += offset.x;
+			cy[i] += offset.y;
+			cz[i] += offset.z;
+		}
+		bvh.Translate(offset);
+	}
+
+private:
+	// Position of the nearest hit in the reordered arrays.
+	int FindStored(Ray& ray, float& t)
+	{
+		int nearest = -1;
+
+		bvh.TraverseLeaves(ray, t, [&](int first, int n, float& tMax) {
+			const int i = IntersectRange(ray, first, n, tMax);
+			if (i >= 0) nearest = i;
+		});
+
+		return nearest;
+	}
+
+	int IntersectRange(Ray& ray, int first, int n, float& tMax)
+	{
+		int i = -1;
+		TRACE_STAT(threadStats.intersectionTests += n);
+
+#if RAYTRACER_SIMD
+		if (simdLevel == SimdLevel::AVX2) i = PacketAVX2::IntersectSpheres(ray, &cx[first], &cy[first], &cz[first], &radii[first], n, tMax);
+		else if (simdLevel == SimdLevel::SSE) i = PacketSSE::IntersectSpheres(ray, &cx[first], &cy[first], &cz[first], &radii[first], n, tMax);
+		else i = IntersectRangeScalar(ray, first, n, tMax);
+#else
+		i = IntersectRangeScalar(ray, first, n, tMax);
+#endif
+
+		return i >= 0 ? first + i : -1;
+	}
+
+	int IntersectRangeScalar(Ray& ray, int first, int n, float& tMax)
+	{
+		int nearest = -1;
+
+		for (int i = 0; i < n; i++)
+		{
+			const vec3 oc = ray.start - Center(first + i);
+			const float b = glm::dot(ray.dir, oc);
+			const float c = glm::dot(oc, oc) - radii[first + i] * radii[first + i];
+			const float det = b * b - c;
+			if (det < 0) continue;
+
+			const float d1 = (-b + glm::sqrt(det));
+			const float d2 = (-b - glm::sqrt(det));
+			float t = glm::min(d1, d2);
+			if (t < 0) t = glm::max(d1, d2);
+
+			if (t >= 0 && t < tMax)
+			{
+				tMax = t;
+				nearest = i;
+			}
+		}
+
+		return nearest;
+	}
+
+	template<typename T>
+	void Reorder(std::vector<T>& values)
+	{
+		std::vector<T> sorted(count);
+		for (int i = 0; i < count; i++) sorted[i] = values[ids[i]];
+		values.swap(sorted);
+	}
+};
\ No newline at end of file
@@ -11,23 +11,33 @@ public:
 
 	Square(vec3 v0, vec3 v1, vec3 v2, vec3 v3, 
 		vec2 uv0 = vec2(0), vec2 uv1 = vec2(0), 
-		vec2 uv2 = vec2(0), vec2 uv3 = vec2(0)) : t1(v0, v1, v2), t2(v0, v2, v3)
+		vec2 uv2 = vec2(0), vec2 uv3 = vec2(0)) : t1(v0, v1, v2, uv0, uv1, uv2), t2(v0, v2, v3, uv0, uv2, uv3)
 	{
-		t1.uv0 = uv0;
-		t1.uv1 = uv1;
-		t1.uv2 = uv2;
-
-		t2.uv0 = uv0;
-		t2.uv1 = uv2;
-		t2.uv2 = uv3;
 	}
 
 	virtual Hit CheckRayCollision(Ray& ray) {
-		auto hit1 = t1.CheckRayCollision(ray);
-		auto hit2 = t2.CheckRayCollision(ray);
+		float d1 = 0, d2 = 0, a1 = 0, a2 = 0, b1 = 0, b2 = 0;
+		const bool hit1 = t1.record.Intersect(ray, d1, a1, a2);
+		const bool hit2 = t2.record.Intersect(ray, d2, b1, b2);
+
+		// only the nearer half fills in a hit; on the shared diagonal that is t2
+		if (hit2 && (!hit1 || d2 <= d1)) return t2.HitAt(ray, d2, b1, b2);
+		if (hit1) return t1.HitAt(ray, d1, a1, a2);
+		return Hit{ -1, vec3(0), vec3(0) };
+	}
+
+	virtual AABB GetBounds() {
+		AABB bounds = t1.GetBounds();
+		bounds.Expand(t2.GetBounds());
+		return bounds;
+	}
+
+	virtual bool Convex() const {
+		return true;
+	}
 
-		if (hit1.d >= 0 && hit2.d >= 0) return hit1.d < hit2.d ? hit1 : hit2;
-		else if (hit1.d >= 0) return hit1;
-		else return hit2;
+	virtual void Translate(const vec3& offset) {
+		t1.Translate(offset);
+		t2.Translate(offset);
 	}
 };
\ No newline at end of file
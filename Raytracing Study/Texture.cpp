@@ -2,20 +2,99 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h" 
 #include "Texture.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 
-Texture::Texture(const std::string& filename)
+namespace
 {
-	unsigned char* img = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-	
-	image.resize(width * height * channels);
-	memcpy(image.data(), img, image.size() * sizeof(uint8_t));
+	// Layout of a .rtt file: the header, one TiledLevel per mip level, then the tiles of every
+	// level row by row, starting at the first page boundary. Each tile is tileSize^2 RGBA8
+	// texels; tiles on the right and bottom edges repeat the last column and row.
+	struct TiledHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t width, height;
+		uint32_t levelCount;
+		uint32_t tileSize;
+	};
 
-	delete img;
+	struct TiledLevel
+	{
+		uint32_t width, height;
+		uint32_t tilesX, tilesY;
+		uint64_t offset;
+	};
+
+	const char tiledMagic[4] = { 'R', 'T', 'T', 'X' };
+	const uint32_t tiledVersion = 1;
+	const size_t tiledAlignment = 4096;
+	const size_t tileBytes = size_t(Texture::tileSize) * Texture::tileSize * 4;
+
+	bool HasExtension(const std::string& filename, const std::string& extension)
+	{
+		return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+	}
+
+	std::string TiledName(const std::string& filename)
+	{
+		const size_t dot = filename.find_last_of('.');
+		const size_t slash = filename.find_last_of("/\\");
+		const bool hasExtension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+		return (hasExtension ? filename.substr(0, dot) : filename) + ".rtt";
+	}
+
+	// Whether tiled was converted from source after its last change. A missing source leaves
+	// nothing to compare against, so the conversion stands.
+	bool TiledIsCurrent(const std::string& tiled, const std::string& source)
+	{
+		std::error_code error;
+		const auto sourceTime = std::filesystem::last_write_time(source, error);
+		if (error) return true;
+
+		const auto tiledTime = std::filesystem::last_write_time(tiled, error);
+		return !error && tiledTime >= sourceTime;
+	}
+}
+
+Texture::Texture(const std::string& filename) : source(filename)
+{
+	if (HasExtension(filename, ".rtt"))
+	{
+		if (MapTiled(filename)) return;
+
+		std::cout << "Failed to map texture " << filename << std::endl;
+
+		width = height = 1;
+		channels = 3;
+		const uint8_t black[3] = {};
+		BuildMips(black);
+		return;
+	}
+
+	// gray and gray+alpha files are expanded to RGB on load; channels would report the file's count
+	unsigned char* img = stbi_load(filename.c_str(), &width, &height, &channels, 3);
+
+	if (!img)
+	{
+		std::cout << "Failed to load texture " << filename << std::endl;
+
+		width = height = 1;
+		channels = 3;
+		const uint8_t black[3] = {};
+		BuildMips(black);
+		return;
+	}
+
+	channels = 3;
+	BuildMips(img);
+	stbi_image_free(img);
 }
 
 Texture::Texture(const int& width, const int& height, const std::vector<vec3>& pixels) : width(width), height(height), channels(3)
 {
-	image.resize(width * height * channels); 
+	std::vector<uint8_t> image(width * height * channels);
 
 	for (int i = 0; i < height; i++) {
 		for (int j = 0; j < width; j++) {
@@ -26,4 +105,168 @@ Texture::Texture(const int& width, const int& height, const std::vector<vec3>& p
 			image[(j + i * width) * channels + 2] = uint8_t(color.b * 255);
 		}
 	}
-}
\ No newline at end of file
+
+	BuildMips(image.data());
+}
+
+// Level 0 repacks the decoded pixels, of channels bytes each, as RGBA8; every further level
+// averages 2x2 texels of the one above, the last row or column repeating when a size is odd.
+// The decoded pixels are not needed after.
+void Texture::BuildMips(const uint8_t* pixels)
+{
+	levels.clear();
+
+	Level base{ width, height, std::vector<uint8_t>(size_t(width) * height * 4) };
+	for (size_t i = 0; i < size_t(width) * height; i++)
+	{
+		for (int c = 0; c < 3; c++) base.texels[i * 4 + c] = pixels[i * channels + c];
+		base.texels[i * 4 + 3] = 255;
+	}
+	levels.push_back(std::move(base));
+
+	while (levels.back().width > 1 || levels.back().height > 1)
+	{
+		const Level& above = levels.back();
+
+		Level level{ glm::max(above.width / 2, 1), glm::max(above.height / 2, 1), {} };
+		level.texels.resize(size_t(level.width) * level.height * 4);
+
+		for (int j = 0; j < level.height; j++) {
+			for (int i = 0; i < level.width; i++) {
+				const int x0 = glm::min(i * 2, above.width - 1), x1 = glm::min(i * 2 + 1, above.width - 1);
+				const int y0 = glm::min(j * 2, above.height - 1), y1 = glm::min(j * 2 + 1, above.height - 1);
+
+				const uint8_t* a = &above.texels[(x0 + size_t(y0) * above.width) * 4];
+				const uint8_t* b = &above.texels[(x1 + size_t(y0) * above.width) * 4];
+				const uint8_t* c = &above.texels[(x0 + size_t(y1) * above.width) * 4];
+				const uint8_t* d = &above.texels[(x1 + size_t(y1) * above.width) * 4];
+
+				uint8_t* texel = &level.texels[(i + size_t(j) * level.width) * 4];
+				for (int k = 0; k < 4; k++) texel[k] = uint8_t((a[k] + b[k] + c[k] + d[k] + 2) / 4);
+			}
+		}
+
+		levels.push_back(std::move(level));
+	}
+}
+
+std::shared_ptr<Texture> Texture::Open(const std::string& filename)
+{
+	const std::string tiled = TiledName(filename);
+	if (tiled != filename && std::ifstream(tiled, std::ios::binary))
+	{
+		if (TiledIsCurrent(tiled, filename))
+		{
+			auto texture = std::make_shared<Texture>(tiled);
+			if (texture->IsMapped()) return texture;
+		}
+		else std::cout << tiled << " is older than " << filename << ", decoding the source; rerun texconvert" << std::endl;
+	}
+
+	return std::make_shared<Texture>(filename);
+}
+
+bool Texture::MapTiled(const std::string& filename)
+{
+	if (!file.Open(filename) || file.Size() < sizeof(TiledHeader)) return false;
+
+	TiledHeader header;
+	memcpy(&header, file.Data(), sizeof(header));
+	if (memcmp(header.magic, tiledMagic, sizeof(tiledMagic)) != 0 || header.version != tiledVersion) return false;
+	if (header.tileSize != uint32_t(tileSize) || header.levelCount == 0 || header.levelCount > 32) return false;
+	if (file.Size() < sizeof(TiledHeader) + header.levelCount * sizeof(TiledLevel)) return false;
+
+	std::vector<TiledLevel> table(header.levelCount);
+	memcpy(table.data(), file.Data() + sizeof(TiledHeader), table.size() * sizeof(TiledLevel));
+
+	int tileCount = 0;
+	for (auto& level : table)
+	{
+		if (level.width == 0 || level.height == 0) return false;
+		if (level.tilesX != (level.width + tileSize - 1) / tileSize || level.tilesY != (level.height + tileSize - 1) / tileSize) return false;
+
+		const uint64_t bytes = uint64_t(level.tilesX) * level.tilesY * tileBytes;
+		if (level.offset % tiledAlignment != 0 || level.offset > file.Size() || bytes > file.Size() - level.offset) return false;
+
+		tileCount += int(level.tilesX * level.tilesY);
+	}
+
+	width = int(header.width);
+	height = int(header.height);
+	channels = 4;
+	residency = std::make_unique<TileResidency>(tileCount);
+
+	levels.clear();
+	int firstTile = 0;
+	for (auto& entry : table)
+	{
+		Level level{ int(entry.width), int(entry.height), {} };
+		level.tiles = file.Data() + entry.offset;
+		level.tilesX = int(entry.tilesX);
+		level.firstTile = firstTile;
+		level.residency = residency.get();
+		levels.push_back(std::move(level));
+
+		firstTile += int(entry.tilesX * entry.tilesY);
+	}
+
+	return true;
+}
+
+bool Texture::WriteTiled(const std::string& filename) const
+{
+	TiledHeader header;
+	memcpy(header.magic, tiledMagic, sizeof(tiledMagic));
+	header.version = tiledVersion;
+	header.width = uint32_t(width);
+	header.height = uint32_t(height);
+	header.levelCount = uint32_t(levels.size());
+	header.tileSize = uint32_t(tileSize);
+
+	std::vector<TiledLevel> table(levels.size());
+	uint64_t offset = (sizeof(TiledHeader) + table.size() * sizeof(TiledLevel) + tiledAlignment - 1) / tiledAlignment * tiledAlignment;
+	for (size_t l = 0; l < levels.size(); l++)
+	{
+		table[l].width = uint32_t(levels[l].width);
+		table[l].height = uint32_t(levels[l].height);
+		table[l].tilesX = uint32_t((levels[l].width + tileSize - 1) / tileSize);
+		table[l].tilesY = uint32_t((levels[l].height + tileSize - 1) / tileSize);
+		table[l].offset = offset;
+		offset += uint64_t(table[l].tilesX) * table[l].tilesY * tileBytes;
+	}
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out) return false;
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(TiledLevel));
+
+	std::vector<char> padding(size_t(table[0].offset) - sizeof(TiledHeader) - table.size() * sizeof(TiledLevel), 0);
+	out.write(padding.data(), padding.size());
+
+	std::vector<uint8_t> tile(tileBytes);
+	for (size_t l = 0; l < levels.size(); l++)
+	{
+		const Level& level = levels[l];
+
+		for (uint32_t ty = 0; ty < table[l].tilesY; ty++) {
+			for (uint32_t tx = 0; tx < table[l].tilesX; tx++) {
+				for (int y = 0; y < tileSize; y++) {
+					for (int x = 0; x < tileSize; x++) {
+						const int i = glm::min(int(tx) * tileSize + x, level.width - 1);
+						const int j = glm::min(int(ty) * tileSize + y, level.height - 1);
+						const vec3 color = glm::clamp(level.Texel(i, j), vec3(0), vec3(1));
+
+						uint8_t* texel = &tile[(y * tileSize + x) * 4];
+						for (int c = 0; c < 3; c++) texel[c] = uint8_t(color[c] * 255 + 0.5f);
+						texel[3] = 255;
+					}
+				}
+
+				out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+			}
+		}
+	}
+
+	return bool(out);
+}
@@ -2,31 +2,157 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <cstdint>
+#include <memory>
+#include <atomic>
 #include <glm/glm.hpp>
+#include "MappedFile.h"
+#include "TraceStats.h"
 using namespace glm;
 
+// Remembers which tiles of a mapped texture have been sampled at least once.
+class TileResidency
+{
+public:
+	const int tileCount;
+
+	TileResidency(int tileCount) : tileCount(tileCount), bits((tileCount + 31) / 32)
+	{
+	}
+
+	void Touch(int tile)
+	{
+		std::atomic<uint32_t>& word = bits[tile >> 5];
+		const uint32_t mask = 1u << (tile & 31);
+		if (word.load(std::memory_order_relaxed) & mask) return;
+		if (!(word.fetch_or(mask, std::memory_order_relaxed) & mask)) touched.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	int Touched() const
+	{
+		return touched.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::vector<std::atomic<uint32_t>> bits;
+	std::atomic<int> touched{ 0 };
+};
+
 class Texture
 {
 public:
+	// Tiled files (.rtt) store every level as square RGBA8 tiles of tileSize texels, one page each.
+	static const int tileShift = 5;
+	static const int tileSize = 1 << tileShift;
+
+	// One level of the mip chain, as RGBA8 texels converted to floats when read. Decoded textures
+	// keep them row by row in texels, mapped ones read straight from the tiles of the file.
+	struct Level
+	{
+		int width, height;
+		std::vector<uint8_t> texels;
+
+		const uint8_t* tiles = nullptr;
+		int tilesX = 0;
+		int firstTile = 0;
+		TileResidency* residency = nullptr;
+
+		vec3 Texel(int i, int j) const
+		{
+			const uint8_t* texel;
+			if (!tiles) texel = &texels[(size_t(j) * width + i) * 4];
+			else
+			{
+				const int tile = (j >> tileShift) * tilesX + (i >> tileShift);
+				residency->Touch(firstTile + tile);
+
+				texel = tiles + ((size_t(tile) << (2 * tileShift)) + ((j & (tileSize - 1)) << tileShift) + (i & (tileSize - 1))) * 4;
+			}
+
+			return vec3(texel[0] / 255.0f, texel[1] / 255.0f, texel[2] / 255.0f);
+		}
+
+		vec3 GetWrapped(int i, int j) const
+		{
+			if (unsigned(i) >= unsigned(width)) {
+				i %= width;
+				if (i < 0) i += width;
+			}
+			if (unsigned(j) >= unsigned(height)) {
+				j %= height;
+				if (j < 0) j += height;
+			}
+
+			return Texel(i, j);
+		}
+
+		vec3 SampleLinear(const vec2& uv) const
+		{
+			vec2 xy = uv * vec2(width, height) - vec2(0.5f);
+			int i = int(floor(xy.x));
+			int j = int(floor(xy.y));
+			float dx = xy.x - i;
+			float dy = xy.y - j;
+			TRACE_STAT(threadStats.textureFetches += 4);
+
+			vec3 a = GetWrapped(i, j) * (1 - dx) + GetWrapped(i + 1, j) * dx;
+			vec3 b = GetWrapped(i, j + 1) * (1 - dx) + GetWrapped(i + 1, j + 1) * dx;
+			return a * (1 - dy) + b * dy;
+		}
+	};
+
 	int width, height, channels;
-	std::vector<uint8_t> image;
+	std::vector<Level> levels;
+
+	// File the texels came from, the tiled conversion when Open picked it; empty when generated.
+	std::string source;
 
+	// Loads a .rtt file by mapping it, anything else by decoding it.
 	Texture(const std::string& filename);
 	Texture(const int& width, const int& height, const std::vector<vec3>& pixels);
 
-	vec3 GetWrapped(int i, int j)
+	// Prefers the tiled conversion of filename (same name, .rtt extension) when one exists and is
+	// not older than filename.
+	static std::shared_ptr<Texture> Open(const std::string& filename);
+
+	// Writes the mip chain as a .rtt file.
+	bool WriteTiled(const std::string& filename) const;
+
+	bool IsMapped() const
 	{
-		i %= width;
-		j %= height;
+		return residency != nullptr;
+	}
 
-		if (i < 0) i += width;
-		if (j < 0) j += height;
+	int TileCount() const
+	{
+		return residency ? residency->tileCount : 0;
+	}
 
-		float r = image[(i + width * j) * channels + 0] / 255.0f;
-		float g = image[(i + width * j) * channels + 1] / 255.0f;
-		float b = image[(i + width * j) * channels + 2] / 255.0f;
+	// Tiles sampled so far; the rest of the file has not been read.
+	int TouchedTiles() const
+	{
+		return residency ? residency->Touched() : 0;
+	}
 
-		return vec3(r, g, b);
+	// Trilinear lookup; footprint is the width of the sample in uv units. A footprint of at most
+	// one texel reads the full-resolution level bilinearly, like SampleLinear.
+	vec3 Sample(const vec2& uv, float footprint) const
+	{
+		const float lod = footprint > 0 ? glm::log2(footprint * float(glm::max(width, height))) : 0.0f;
+		if (lod <= 0) return levels[0].SampleLinear(uv);
+
+		const int last = int(levels.size()) - 1;
+		if (lod >= last) return levels[last].SampleLinear(uv);
+
+		const int level = int(lod);
+		const float t = lod - level;
+		return levels[level].SampleLinear(uv) * (1 - t) + levels[level + 1].SampleLinear(uv) * t;
+	}
+
+	vec3 GetWrapped(int i, int j)
+	{
+		TRACE_STAT(threadStats.textureFetches++);
+		return levels[0].GetWrapped(i, j);
 	}
 
 	vec3 InterpolateBilinear(float& dx, float& dy, const vec3& v00, const vec3& v10, const vec3& v01, const vec3& v11)
@@ -48,12 +174,13 @@ public:
 
 	vec3 SampleLinear(vec2& uv)
 	{
-		vec2 xy = uv * vec2(width, height) - vec2(0.5f);
-		int i = floor(xy.x);
-		int j = floor(xy.y);
-		float dx = xy.x - i;
-		float dy = xy.y - j;
-
-		return InterpolateBilinear(dx, dy, GetWrapped(i, j), GetWrapped(i + 1, j), GetWrapped(i, j + 1), GetWrapped(i + 1, j + 1));
+		return levels[0].SampleLinear(uv);
 	}
+
+private:
+	MappedFile file;
+	std::unique_ptr<TileResidency> residency;
+
+	void BuildMips(const uint8_t* pixels);
+	bool MapTiled(const std::string& filename);
 };
\ No newline at end of file
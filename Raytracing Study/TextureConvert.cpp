@@ -0,0 +1,52 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "Texture.h"
+
+// Converts images into tiled .rtt files with their mip chains, which Texture::Open maps instead
+// of decoding. Each output goes to the working directory unless -o names it.
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::cout << "usage: texconvert <image> [-o <file.rtt>] [<image> ...]\n";
+		return 1;
+	}
+
+	int failed = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string input = argv[i];
+
+		std::string output;
+		if (i + 2 < argc && std::string(argv[i + 1]) == "-o")
+		{
+			output = argv[i + 2];
+			i += 2;
+		}
+		else
+		{
+			const size_t slash = input.find_last_of("/\\");
+			const std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+			const size_t dot = name.find_last_of('.');
+			output = (dot == std::string::npos ? name : name.substr(0, dot)) + ".rtt";
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		Texture texture(input);
+
+		if (!texture.WriteTiled(output))
+		{
+			std::cout << "Failed to write " << output << std::endl;
+			failed++;
+			continue;
+		}
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << input << " -> " << output << ": " << texture.width << "x" << texture.height << ", "
+			<< texture.levels.size() << " levels, " << seconds * 1000 << " ms" << std::endl;
+	}
+
+	return failed ? 1 : 0;
+}
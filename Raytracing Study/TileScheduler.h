@@ -0,0 +1,190 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Persistent worker pool that splits a frame into square tiles. Each worker owns a deque of
+// tiles, works from its back and steals from the front of the others' once its own runs dry.
+class TileScheduler
+{
+public:
+	struct Tile
+	{
+		int x0, y0, x1, y1;
+	};
+
+	struct ThreadStats
+	{
+		double busy = 0;
+		double idle = 0;
+		int tiles = 0;
+		int steals = 0;
+	};
+
+	std::vector<ThreadStats> stats;
+	double frameTime = 0;
+
+	TileScheduler(int threadCount = 0)
+	{
+		if (threadCount <= 0) threadCount = glm::max(int(std::thread::hardware_concurrency()), 1);
+
+		queues = std::vector<Queue>(threadCount);
+		stats.resize(threadCount);
+
+		for (int i = 0; i < threadCount; i++) threads.emplace_back(&TileScheduler::WorkerLoop, this, i);
+	}
+
+	~TileScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		startCv.notify_all();
+
+		for (auto& t : threads) t.join();
+	}
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	int ThreadCount() const
+	{
+		return int(threads.size());
+	}
+
+	// Blocks until every tile of the width x height image has been passed to work(tile, thread).
+	void Run(int width, int height, int tileSize, const std::function<void(const Tile&, int)>& work)
+	{
+		Run(Tile{ 0, 0, width, height }, tileSize, work);
+	}
+
+	// Run over the pixels of area only, with tiles counted from its corner.
+	void Run(const Tile& area, int tileSize, const std::function<void(const Tile&, int)>& work)
+	{
+		tileSize = glm::max(tileSize, 1);
+
+		tiles.clear();
+		for (int y = area.y0; y < area.y1; y += tileSize)
+			for (int x = area.x0; x < area.x1; x += tileSize)
+				tiles.push_back(Tile{ x, y, glm::min(x + tileSize, area.x1), glm::min(y + tileSize, area.y1) });
+
+		// contiguous runs keep neighbouring tiles on one thread until stealing kicks in
+		const int n = ThreadCount();
+		const int tileCount = int(tiles.size());
+		for (int i = 0; i < n; i++)
+		{
+			queues[i].tiles.clear();
+			for (int t = tileCount * i / n; t < tileCount * (i + 1) / n; t++) queues[i].tiles.push_back(t);
+			stats[i] = ThreadStats();
+		}
+
+		job = &work;
+		const auto start = std::chrono::steady_clock::now();
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			activeWorkers = n;
+			generation++;
+			startCv.notify_all();
+			doneCv.wait(lock, [&] { return activeWorkers == 0; });
+		}
+
+		frameTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		for (auto& s : stats) s.idle = glm::max(frameTime - s.busy, 0.0);
+
+		job = nullptr;
+	}
+
+	// Splits [0, count) into runs of chunkSize and passes each to work(begin, end, thread).
+	void RunRange(int count, int chunkSize, const std::function<void(int, int, int)>& work)
+	{
+		Run(count, 1, chunkSize, [&](const Tile& tile, int thread) { work(tile.x0, tile.x1, thread); });
+	}
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<int> tiles;
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<Queue> queues;
+	std::vector<Tile> tiles;
+	const std::function<void(const Tile&, int)>* job = nullptr;
+
+	std::mutex mutex;
+	std::condition_variable startCv, doneCv;
+	uint64_t generation = 0;
+	int activeWorkers = 0;
+	bool quit = false;
+
+	bool PopLocal(int self, int& tile)
+	{
+		std::lock_guard<std::mutex> lock(queues[self].mutex);
+		if (queues[self].tiles.empty()) return false;
+
+		tile = queues[self].tiles.back();
+		queues[self].tiles.pop_back();
+		return true;
+	}
+
+	bool Steal(int self, int& tile)
+	{
+		const int n = ThreadCount();
+		for (int i = 1; i < n; i++)
+		{
+			Queue& victim = queues[(self + i) % n];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.tiles.empty()) continue;
+
+			tile = victim.tiles.front();
+			victim.tiles.pop_front();
+			return true;
+		}
+		return false;
+	}
+
+	void WorkerLoop(int self)
+	{
+		uint64_t seen = 0;
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				startCv.wait(lock, [&] { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation;
+			}
+
+			ThreadStats& s = stats[self];
+			int tile;
+			while (true)
+			{
+				if (!PopLocal(self, tile))
+				{
+					if (!Steal(self, tile)) break;
+					s.steals++;
+				}
+
+				const auto start = std::chrono::steady_clock::now();
+				(*job)(tiles[tile], self);
+				s.busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				s.tiles++;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--activeWorkers == 0) doneCv.notify_one();
+			}
+		}
+	}
+};
\ No newline at end of file
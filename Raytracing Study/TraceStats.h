@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+
+// Build with RAYTRACER_STATS=0 and every TRACE_STAT update disappears.
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 1
+#endif
+
+#if RAYTRACER_STATS
+#define TRACE_STAT(update) (update)
+#else
+#define TRACE_STAT(update) ((void)0)
+#endif
+
+// Work done while rendering. Intersection tests count single ray-primitive tests (a square is
+// two triangles, a packet test counts every lane) and texture fetches count texels read.
+struct TraceStats
+{
+	uint64_t primaryRays = 0;
+	uint64_t shadowRays = 0;
+	uint64_t reflectionRays = 0;
+	uint64_t refractionRays = 0;
+
+	uint64_t nodeVisits = 0;
+	uint64_t intersectionTests = 0;
+	uint64_t textureFetches = 0;
+
+	uint64_t shadowQueries = 0;
+	uint64_t shadowEarlyExits = 0;
+	uint64_t shadowCacheHits = 0;
+	uint64_t prunedBranches = 0;
+
+	uint64_t Rays() const
+	{
+		return primaryRays + shadowRays + reflectionRays + refractionRays;
+	}
+
+	TraceStats& operator+=(const TraceStats& other)
+	{
+		primaryRays += other.primaryRays;
+		shadowRays += other.shadowRays;
+		reflectionRays += other.reflectionRays;
+		refractionRays += other.refractionRays;
+		nodeVisits += other.nodeVisits;
+		intersectionTests += other.intersectionTests;
+		textureFetches += other.textureFetches;
+		shadowQueries += other.shadowQueries;
+		shadowEarlyExits += other.shadowEarlyExits;
+		shadowCacheHits += other.shadowCacheHits;
+		prunedBranches += other.prunedBranches;
+		return *this;
+	}
+
+	TraceStats operator-(const TraceStats& other) const
+	{
+		TraceStats d;
+		d.primaryRays = primaryRays - other.primaryRays;
+		d.shadowRays = shadowRays - other.shadowRays;
+		d.reflectionRays = reflectionRays - other.reflectionRays;
+		d.refractionRays = refractionRays - other.refractionRays;
+		d.nodeVisits = nodeVisits - other.nodeVisits;
+		d.intersectionTests = intersectionTests - other.intersectionTests;
+		d.textureFetches = textureFetches - other.textureFetches;
+		d.shadowQueries = shadowQueries - other.shadowQueries;
+		d.shadowEarlyExits = shadowEarlyExits - other.shadowEarlyExits;
+		d.shadowCacheHits = shadowCacheHits - other.shadowCacheHits;
+		d.prunedBranches = prunedBranches - other.prunedBranches;
+		return d;
+	}
+};
+
+// Tallies of the calling thread; Render sums the difference over each tile into Raytracer::lastStats.
+inline thread_local TraceStats threadStats;
@@ -2,69 +2,128 @@
 #include <glm/glm.hpp>
 #include "Object.h"
 
+// A triangle prepared for the Moller-Trumbore test: its first vertex, the edges from it to the
+// other two and its unit normal, computed once when the scene is built instead of for every ray.
+// The packet kernels read the same records.
+class TriangleRecord
+{
+public:
+	vec3 v0, e1, e2;
+	vec3 normal;
+
+	TriangleRecord()
+	{
+	}
+
+	TriangleRecord(const vec3& v0, const vec3& v1, const vec3& v2) : v0(v0), e1(v1 - v0), e2(v2 - v0)
+	{
+		normal = glm::normalize(glm::cross(e1, e2));
+	}
+
+	// Only front faces are hit, as in the packet kernels. w1 and w2 are the barycentric weights of
+	// v1 and v2. Hits at any angle count, down to rays that graze the plane.
+	bool Intersect(const Ray& ray, float& t, float& w1, float& w2) const
+	{
+		TRACE_STAT(threadStats.intersectionTests++);
+
+		const vec3 p = glm::cross(ray.dir, e2);
+		const float det = glm::dot(e1, p);
+
+		// back faces, rays parallel to the plane and degenerate triangles
+		if (!(det > 0)) return false;
+
+		// the weights scaled by det, so a miss costs no division
+		const vec3 s = ray.start - v0;
+		const float u = glm::dot(s, p);
+		if (u < 0 || u > det) return false;
+
+		const vec3 q = glm::cross(s, e1);
+		const float v = glm::dot(ray.dir, q);
+		if (v < 0 || u + v > det) return false;
+
+		const float inverse = 1 / det;
+		t = glm::dot(e2, q) * inverse;
+		if (t < 0) return false;
+
+		w1 = u * inverse;
+		w2 = v * inverse;
+		return true;
+	}
+
+	void Translate(const vec3& offset)
+	{
+		v0 += offset;
+	}
+};
+
 class Triangle : public Object
 {
 public:
 	vec3 v0, v1, v2;
 	vec2 uv0, uv1, uv2;
 
+	TriangleRecord record;
+	float uvScale = 0;
+
 	Triangle() : v0(vec3(0)), v1(vec3(0)), v2(vec3(0)), uv0(vec2(0)), uv1(vec2(0)), uv2(vec2(0))
 	{
-
+		Build();
 	}
 
 	Triangle(vec3 v0, vec3 v1, vec3 v2, vec2 uv0 = vec2(0), vec2 uv1 = vec2(0), vec2 uv2 = vec2(0)) : v0(v0), v1(v1), v2(v2), uv0(uv0), uv1(uv1), uv2(uv2)
 	{
+		Build();
+	}
 
+	// Must be called after the vertices or uvs change.
+	void Build()
+	{
+		record = TriangleRecord(v0, v1, v2);
+		uvScale = UVScale(v0, v1, v2, uv0, uv1, uv2);
 	}
 
 	virtual Hit CheckRayCollision(Ray& ray) {
-		Hit hit = Hit{ -1, vec3(0), vec3(0) };
-
-		vec3 point, normal;
-		float t, w0, w1;
-		if (IntersectRayTriangle(ray, v0, v1, v2, point, normal, t, w0, w1)) {
-			hit.d = t;
-			hit.point = point;
-			hit.normal = normal;
-			hit.uv = uv0 * w0 + uv1 * w1 + uv2 * (1 - w0 - w1);
-		}
+		float t, w1, w2;
+		if (!record.Intersect(ray, t, w1, w2)) return Hit{ -1, vec3(0), vec3(0) };
 
-		return hit;
+		return HitAt(ray, t, w1, w2);
 	}
 
-	bool IntersectRayTriangle(
-		Ray& ray, vec3 v0, vec3 v1, vec3 v2, 
-		vec3& point, vec3& normal, 
-		float& t, float& w0, float& w1) 
+	// The hit record.Intersect found at t with the weights w1 and w2.
+	Hit HitAt(const Ray& ray, float t, float w1, float w2) const
 	{
-		normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
-
-		if (glm::dot(-ray.dir, normal) < 0) return false;
-		if (glm::abs(glm::dot(ray.dir, normal)) < 1e-2f) return false; 
-
-		t = (glm::dot(-ray.start, normal) + glm::dot(v0, normal)) / glm::dot(ray.dir, normal);
-
-		if (t < 0) return false;
+		Hit hit = Hit{ t, ray.start + t * ray.dir, record.normal };
+		hit.uv = uv0 * (1 - w1 - w2) + uv1 * w1 + uv2 * w2;
+		hit.uvScale = uvScale;
+		return hit;
+	}
 
-		point = ray.start + t * ray.dir;
+	virtual AABB GetBounds() {
+		AABB bounds;
+		bounds.Expand(v0);
+		bounds.Expand(v1);
+		bounds.Expand(v2);
+		return bounds;
+	}
 
-		vec3 cross0 = glm::cross(v1 - point, v2 - point);
-		vec3 cross1 = glm::cross(v2 - point, v0 - point);
-		vec3 cross2 = glm::cross(v0 - point, v1 - point);
+	virtual bool Convex() const {
+		return true;
+	}
 
-		if (glm::dot(cross0, normal) < 0) return false;
-		if (glm::dot(cross1, normal) < 0) return false;
-		if (glm::dot(cross2, normal) < 0) return false;
+	virtual void Translate(const vec3& offset) {
+		v0 += offset;
+		v1 += offset;
+		v2 += offset;
+		record.Translate(offset);
+	}
 
-		float a0 = glm::length(cross0) * 0.5f;
-		float a1 = glm::length(cross1) * 0.5f;
-		float a2 = glm::length(cross2) * 0.5f;
-		float a = a0 + a1 + a2;
-		
-		w0 = a0 / a;
-		w1 = a1 / a;
+	// Square root of the uv area over the world area, i.e. how far uv moves per unit of distance.
+	static float UVScale(const vec3& v0, const vec3& v1, const vec3& v2, const vec2& uv0, const vec2& uv1, const vec2& uv2)
+	{
+		const vec2 a = uv1 - uv0, b = uv2 - uv0;
+		const float uvArea = glm::abs(a.x * b.y - a.y * b.x);
+		const float area = glm::length(glm::cross(v1 - v0, v2 - v0));
 
-		return true;
+		return area > 0 ? glm::sqrt(uvArea / area) : 0.0f;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,151 @@
+#define GLM_ENABLE_EXPERIMENTAL
+#include "TriangleMesh.h"
+#include <fstream>
+#include <cstdlib>
+#include <cctype>
+#include <unordered_map>
+
+namespace
+{
+	// OBJ indices are 1-based, negative ones count back from the end of the list read so far.
+	bool ResolveIndex(long index, size_t size, int& resolved)
+	{
+		if (index > 0) resolved = int(index - 1);
+		else if (index < 0) resolved = int(long(size) + index);
+		else return false;
+
+		return resolved >= 0 && size_t(resolved) < size;
+	}
+
+	const char* SkipSpaces(const char* s)
+	{
+		while (*s == ' ' || *s == '\t') s++;
+		return s;
+	}
+}
+
+std::shared_ptr<TriangleMesh> TriangleMesh::LoadObj(const std::string& filename, vec3 color)
+{
+	std::ifstream file(filename);
+	if (!file)
+	{
+		std::cout << "Failed to load mesh " << filename << std::endl;
+		return nullptr;
+	}
+
+	std::vector<vec3> objPositions;
+	std::vector<vec2> objUvs;
+
+	auto mesh = std::make_shared<TriangleMesh>(color);
+
+	// a mesh vertex is one distinct (position, uv) pair of the file
+	std::unordered_map<uint64_t, uint32_t> vertexIds;
+	std::vector<std::pair<int, int>> corners;
+	bool hasUvs = false;
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		lineNumber++;
+
+		const char* s = SkipSpaces(line.c_str());
+		char* end;
+
+		if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			vec3 p;
+			s += 2;
+			for (int k = 0; k < 3; k++, s = end) p[k] = std::strtof(s, &end);
+
+			// OBJ is right-handed, this scene has z pointing into the screen
+			objPositions.push_back(vec3(p.x, p.y, -p.z));
+		}
+		else if (s[0] == 'v' && s[1] == 't' && (s[2] == ' ' || s[2] == '\t'))
+		{
+			vec2 uv;
+			s += 3;
+			for (int k = 0; k < 2; k++, s = end) uv[k] = std::strtof(s, &end);
+
+			// OBJ puts v = 0 at the bottom of the image, Texture at the top
+			objUvs.push_back(vec2(uv.x, 1 - uv.y));
+		}
+		else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			corners.clear();
+			s = SkipSpaces(s + 2);
+
+			bool valid = true;
+			while (*s && *s != '\r' && *s != '#')
+			{
+				int position = -1, uv = -1;
+
+				valid = valid && ResolveIndex(std::strtol(s, &end, 10), objPositions.size(), position);
+				s = end;
+
+				if (*s == '/')
+				{
+					s++;
+					if (*s != '/')
+					{
+						valid = valid && ResolveIndex(std::strtol(s, &end, 10), objUvs.size(), uv);
+						s = end;
+					}
+					if (*s == '/')
+					{
+						s++;
+						std::strtol(s, &end, 10); // normals are recomputed per triangle
+						s = end;
+					}
+				}
+
+				if (!valid || !(*s == 0 || std::isspace((unsigned char)*s))) break;
+
+				corners.push_back({ position, uv });
+				s = SkipSpaces(s);
+			}
+
+			if (!valid || corners.size() < 3)
+			{
+				std::cout << filename << ":" << lineNumber << ": skipping malformed face" << std::endl;
+				continue;
+			}
+
+			uint32_t ids[3];
+			for (size_t c = 0; c < corners.size(); c++)
+			{
+				const uint64_t key = uint64_t(uint32_t(corners[c].first)) << 32 | uint32_t(corners[c].second);
+
+				auto it = vertexIds.find(key);
+				if (it == vertexIds.end())
+				{
+					it = vertexIds.emplace(key, uint32_t(mesh->positions.size())).first;
+					mesh->positions.push_back(objPositions[corners[c].first]);
+					mesh->uvs.push_back(corners[c].second >= 0 ? objUvs[corners[c].second] : vec2(0));
+					hasUvs = hasUvs || corners[c].second >= 0;
+				}
+
+				// polygons become fans around their first corner; mirroring z flips the winding back
+				if (c == 0) ids[0] = it->second;
+				else if (c == 1) ids[2] = it->second;
+				else
+				{
+					ids[1] = it->second;
+					mesh->indices.insert(mesh->indices.end(), { ids[0], ids[1], ids[2] });
+					ids[2] = ids[1];
+				}
+			}
+		}
+	}
+
+	if (mesh->indices.empty())
+	{
+		std::cout << "No faces in mesh " << filename << std::endl;
+		return nullptr;
+	}
+
+	if (!hasUvs) mesh->uvs.clear();
+
+	mesh->Build();
+	return mesh;
+}
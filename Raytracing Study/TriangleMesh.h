@@ -0,0 +1,129 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cfloat>
+#include <glm/glm.hpp>
+#include "Object.h"
+#include "Triangle.h"
+#include "BVH.h"
+using namespace glm;
+
+// Triangles sharing one vertex buffer and one material. Each triangle is three entries of
+// indices; uvs is either empty or parallel to positions.
+class TriangleMesh : public Object
+{
+public:
+	std::vector<vec3> positions;
+	std::vector<vec2> uvs;
+	std::vector<uint32_t> indices;
+
+	BVH bvh;
+
+	// One per triangle, built from the buffers by BuildRecords.
+	std::vector<TriangleRecord> records;
+
+	TriangleMesh(vec3 color = vec3(1)) : Object(color)
+	{
+	}
+
+	TriangleMesh(const std::vector<vec3>& vertexPositions, const std::vector<vec2>& vertexUVs, const std::vector<uint32_t>& triangleIndices, vec3 color = vec3(1))
+		: Object(color), positions(vertexPositions), uvs(vertexUVs), indices(triangleIndices)
+	{
+		Build();
+	}
+
+	// Returns nullptr if the file cannot be read or holds no faces.
+	static std::shared_ptr<TriangleMesh> LoadObj(const std::string& filename, vec3 color = vec3(1));
+
+	int TriangleCount() const
+	{
+		return int(indices.size() / 3);
+	}
+
+	AABB TriangleBounds(int i) const
+	{
+		AABB bounds;
+		for (int k = 0; k < 3; k++) bounds.Expand(positions[indices[i * 3 + k]]);
+		return bounds;
+	}
+
+	// Must be called after the buffers change.
+	void Build()
+	{
+		std::vector<AABB> bounds(TriangleCount());
+		for (int i = 0; i < TriangleCount(); i++) bounds[i] = TriangleBounds(i);
+
+		bvh.Build(bounds);
+		BuildRecords();
+	}
+
+	// Enough on its own when bvh already fits the buffers, e.g. read back from a scene cache.
+	void BuildRecords()
+	{
+		records.resize(TriangleCount());
+		for (int i = 0; i < TriangleCount(); i++) records[i] = TriangleRecord(positions[indices[i * 3]], positions[indices[i * 3 + 1]], positions[indices[i * 3 + 2]]);
+	}
+
+	// Uniformly scales and moves the mesh so its longest side is size and its bounds are centered on center.
+	void Fit(const vec3& center, float size)
+	{
+		AABB bounds;
+		for (auto& p : positions) bounds.Expand(p);
+		if (bounds.IsEmpty()) return;
+
+		const vec3 extent = bounds.upper - bounds.lower;
+		const float longest = glm::max(extent.x, glm::max(extent.y, extent.z));
+		const float scale = longest > 0 ? size / longest : 1.0f;
+		const vec3 offset = bounds.Center();
+
+		for (auto& p : positions) p = (p - offset) * scale + center;
+
+		Build();
+	}
+
+	Hit CheckRayCollision(Ray& ray)
+	{
+		Hit hit = Hit{ -1, vec3(0), vec3(0) };
+
+		int nearest = -1;
+		float d = FLT_MAX, w1 = 0, w2 = 0;
+		bvh.Traverse(ray, d, [&](int i, float& tMax) {
+			float t, u, v;
+			if (!records[i].Intersect(ray, t, u, v) || t >= tMax) return;
+
+			tMax = t;
+			nearest = i;
+			w1 = u;
+			w2 = v;
+		});
+
+		// only the nearest triangle fills in the hit
+		if (nearest < 0) return hit;
+
+		hit.d = d;
+		hit.point = ray.start + d * ray.dir;
+		hit.normal = records[nearest].normal;
+		if (!uvs.empty())
+		{
+			const uint32_t i0 = indices[nearest * 3 + 0], i1 = indices[nearest * 3 + 1], i2 = indices[nearest * 3 + 2];
+			hit.uv = uvs[i0] * (1 - w1 - w2) + uvs[i1] * w1 + uvs[i2] * w2;
+			hit.uvScale = Triangle::UVScale(positions[i0], positions[i1], positions[i2], uvs[i0], uvs[i1], uvs[i2]);
+		}
+
+		return hit;
+	}
+
+	AABB GetBounds()
+	{
+		return bvh.IsEmpty() ? AABB() : bvh.nodes[0].bounds;
+	}
+
+	void Translate(const vec3& offset)
+	{
+		for (auto& p : positions) p += offset;
+		for (auto& record : records) record.Translate(offset);
+		bvh.Translate(offset);
+	}
+};